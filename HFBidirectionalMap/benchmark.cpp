@@ -0,0 +1,152 @@
+/*
+ * Copyright 2021 Marzocchi Alessandro
+ * All rights reserved. Distributed under the terms of the MIT license.
+ */
+
+// Times the main operations of HFBiMap and HFBiMultiMap against pairs of QMap and QHash kept in sync by hand.
+// Every measurement is printed as a line of JSON, e.g.
+// {"container":"HFBiMap","key":"int","value":"QString","size":1000,"operation":"find","ns_per_op":52.1}
+// Usage: HFBidirectionalMapBenchmark [maxSize] (sizes go from 1e3 up to maxSize by powers of ten, default 1e6)
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMap>
+#include <QString>
+#include <QVector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <hfbimap.h>
+
+// Distinct keys or values, as multiplying by an odd constant is a bijection of 32 bit integers
+template <class T> struct Sample;
+template <> struct Sample<int>
+{
+  static inline int make(int i, quint32 salt) { return int((quint32(i)*2654435761u)^salt); }
+  static inline const char *name() { return "int"; }
+};
+template <> struct Sample<QString>
+{
+  static inline QString make(int i, quint32 salt) { return QString::number(qulonglong((quint32(i)*2654435761u)^salt)); }
+  static inline const char *name() { return "QString"; }
+};
+
+// Same interface over all the containers being compared
+template <class K, class V, class Map> struct HFAdapter
+{
+  typedef K Key;
+  typedef V Value;
+  Map map;
+  inline void insert(const K &key, const V &value) { map.insert(key, value); }
+  inline bool find(const K &key) const { return map.findConst(key)!=map.constEnd(); }
+  inline bool findValue(const V &value) const { return map.findValueConst(value)!=map.constEnd(); }
+  inline void erase(const K &key) { map.erase(map.find(key)); }
+  inline quint64 iterate() const { quint64 ret=0; for(auto it=map.constBegin();it!=map.constEnd();++it) ret+=qHash(it.key()); return ret; }
+  inline int size() const { return map.size(); }
+};
+template <class K, class V> struct HFBiMapAdapter: HFAdapter<K, V, HFBiMap<K, V> > { static const char *name() { return "HFBiMap"; } };
+template <class K, class V> struct HFBiMultiMapAdapter: HFAdapter<K, V, HFBiMultiMap<K, V> > { static const char *name() { return "HFBiMultiMap"; } };
+// Baselines: a forward and a reverse map
+template <class K, class V, class Forward, class Reverse> struct PairAdapter
+{
+  typedef K Key;
+  typedef V Value;
+  Forward forward;
+  Reverse reverse;
+  inline void insert(const K &key, const V &value) { forward.insert(key, value); reverse.insert(value, key); }
+  inline bool find(const K &key) const { return forward.constFind(key)!=forward.constEnd(); }
+  inline bool findValue(const V &value) const { return reverse.constFind(value)!=reverse.constEnd(); }
+  inline void erase(const K &key) { auto it=forward.find(key); reverse.remove(it.value()); forward.erase(it); }
+  inline quint64 iterate() const { quint64 ret=0; for(auto it=forward.constBegin();it!=forward.constEnd();++it) ret+=qHash(it.key()); return ret; }
+  inline int size() const { return forward.size(); }
+};
+template <class K, class V> struct QMapPairAdapter: PairAdapter<K, V, QMap<K, V>, QMap<V, K> > { static const char *name() { return "QMapPair"; } };
+template <class K, class V> struct QHashPairAdapter: PairAdapter<K, V, QHash<K, V>, QHash<V, K> > { static const char *name() { return "QHashPair"; } };
+
+static volatile quint64 sink;
+
+template <class Adapter> void report(const char *operation, int size, qint64 ns, int ops)
+{
+  printf("{\"container\":\"%s\",\"key\":\"%s\",\"value\":\"%s\",\"size\":%d,\"operation\":\"%s\",\"ns_per_op\":%.1f}\n",
+         Adapter::name(), Sample<typename Adapter::Key>::name(), Sample<typename Adapter::Value>::name(), size, operation, double(ns)/ops);
+  fflush(stdout);
+}
+
+template <class Adapter> void run(int n)
+{
+  typedef typename Adapter::Key Key;
+  typedef typename Adapter::Value Value;
+  QVector<Key> keys;
+  QVector<Value> values;
+  keys.reserve(n);
+  values.reserve(n);
+  for(int i=0;i<n;i++)
+  {
+    keys.append(Sample<Key>::make(i, 0x5bd1e995u));
+    values.append(Sample<Value>::make(i, 0x1b873593u));
+  }
+  // Lookups and erasures visit the entries in an order unrelated to the insertion one
+  QVector<int> order(n);
+  for(int i=0;i<n;i++)
+    order[i]=i;
+  std::shuffle(order.begin(), order.end(), std::mt19937(n));
+
+  Adapter adapter;
+  QElapsedTimer timer;
+  timer.start();
+  for(int i=0;i<n;i++)
+    adapter.insert(keys.at(i), values.at(i));
+  report<Adapter>("insert", n, timer.nsecsElapsed(), n);
+
+  quint64 found=0;
+  timer.restart();
+  for(int i=0;i<n;i++)
+    found+=adapter.find(keys.at(order.at(i)));
+  report<Adapter>("find", n, timer.nsecsElapsed(), n);
+
+  timer.restart();
+  for(int i=0;i<n;i++)
+    found+=adapter.findValue(values.at(order.at(i)));
+  report<Adapter>("findValue", n, timer.nsecsElapsed(), n);
+
+  timer.restart();
+  found+=adapter.iterate();
+  report<Adapter>("iterate", n, timer.nsecsElapsed(), n);
+
+  // The copy is shared until it is modified, so this measures the detach
+  {
+    timer.restart();
+    Adapter copy(adapter);
+    copy.insert(Sample<Key>::make(n, 0x5bd1e995u), Sample<Value>::make(n, 0x1b873593u));
+    report<Adapter>("copyDetach", n, timer.nsecsElapsed(), n);
+    found+=copy.size();
+  }
+
+  timer.restart();
+  for(int i=0;i<n;i++)
+    adapter.erase(keys.at(order.at(i)));
+  report<Adapter>("erase", n, timer.nsecsElapsed(), n);
+  sink=found+quint64(adapter.size());
+}
+
+template <class Key, class Value> void runAll(int n)
+{
+  run<HFBiMapAdapter<Key, Value> >(n);
+  run<HFBiMultiMapAdapter<Key, Value> >(n);
+  run<QMapPairAdapter<Key, Value> >(n);
+  run<QHashPairAdapter<Key, Value> >(n);
+}
+
+int main(int argc, char *argv[])
+{
+  int maxSize=argc>1?atoi(argv[1]):1000000;
+  for(qint64 n=1000;n<=maxSize;n*=10)
+  {
+    runAll<int, int>(int(n));
+    runAll<int, QString>(int(n));
+    runAll<QString, int>(int(n));
+    runAll<QString, QString>(int(n));
+  }
+  return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright 2021 Marzocchi Alessandro
+ * All rights reserved. Distributed under the terms of the MIT license.
+ */
+
+#ifndef HFBiConcurrentMap_Header
+#define HFBiConcurrentMap_Header
+
+#include <QList>
+#include <QMutex>
+#include <QThread>
+#include <QtGlobal>
+#include <atomic>
+#include <new>
+#include <utility>
+#include <hfbimap.h>
+
+/** Read-mostly map shared among threads. Readers never lock nor do atomic read-modify-write operations: they look up the published
+ * version of the map, which is never modified. The writer prepares a new version (a copy of the current one sharing its data until it is
+ * modified, so a batch of updates pays for a single detach) and swaps it in, freeing the old version once no reader can be using it.
+ * Map can be any of the map classes (HFBiMap, HFBiMultiMap, HFBiPersistentMap, HFBiFlatMap...), and its const functions are used by readers.
+ *
+ * Each reading thread looks up the map through a Reader of its own; no Reader may outlive the map. A writer waits for the lookups
+ * running when it publishes, so publish() and update() must not be called from inside read(), which would wait for itself.
+ */
+template <class Key, class Value, class Map = HFBiMap<Key, Value> > class HFBiConcurrentMap
+{
+  // Odd while its reader is looking up the map. On a cache line of its own, as it is written by the reader at every lookup.
+  // Slots are reused rather than freed when their reader goes away, so that a writer can wait on them without holding a lock.
+  struct alignas(64) Slot
+  {
+    Slot(): sequence(0), used(true) { }
+    std::atomic<quint64> sequence;
+    // Guarded by m_slotMutex
+    bool used;
+  };
+public:
+  class Reader
+  {
+    friend class HFBiConcurrentMap<Key, Value, Map>;
+  public:
+    Reader(HFBiConcurrentMap<Key, Value, Map> &map): m_map(&map), m_slot(map.registerSlot()) { }
+    Reader(Reader &&other): m_map(other.m_map), m_slot(other.m_slot) { other.m_slot=nullptr; }
+    ~Reader() { if(m_slot) m_map->unregisterSlot(m_slot); }
+
+    // Calls f with the current version of the map and returns its result, which must not refer to the map contents (e.g. iterators)
+    template <class F> inline auto read(F f) const -> decltype(f(std::declval<const Map &>()))
+    {
+      quint64 sequence=m_slot->sequence.load(std::memory_order_relaxed);
+      // The slot is only ever written by this reader, so a store is enough; being sequentially consistent, it acts as a full fence
+      // and is seen by a writer before this reader loads the current version
+      m_slot->sequence.store(sequence+1, std::memory_order_seq_cst);
+      Section end(m_slot, sequence+2);
+      return f(*m_map->m_current.load(std::memory_order_seq_cst));
+    }
+    inline bool contains(const Key &key) const { return read([&key](const Map &map) { return map.contains(key); }); }
+    inline bool containsValue(const Value &value) const { return read([&value](const Map &map) { return map.containsValue(value); }); }
+    // As findConst and findValueConst, returning a copy of the value (key) found and true, or a default one and false, as iterators
+    // can't outlive the lookup
+    inline QPair<Value, bool> find(const Key &key) const
+    {
+      return read([&key](const Map &map) { auto it=map.findConst(key); return it!=map.constEnd()?qMakePair(Value(it.value()), true):qMakePair(Value(), false); });
+    }
+    inline QPair<Key, bool> findValue(const Value &value) const
+    {
+      return read([&value](const Map &map) { auto it=map.findValueConst(value); return it!=map.constEnd()?qMakePair(Key(it.key()), true):qMakePair(Key(), false); });
+    }
+    inline const Key key(const Value &value, const Key &defaultKey = Key()) const { return read([&](const Map &map) { return map.key(value, defaultKey); }); }
+    inline int size() const { return read([](const Map &map) { return map.size(); }); }
+    // Copy of the current version, that stays valid after the call
+    inline Map snapshot() const { return read([](const Map &map) { return map; }); }
+    inline const Value value(const Key &key, const Value &defaultValue = Value()) const { return read([&](const Map &map) { return map.value(key, defaultValue); }); }
+  private:
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+    // Marks the end of the lookup, after the result has been built
+    struct Section
+    {
+      Section(Slot *slot, quint64 sequence): slot(slot), sequence(sequence) { }
+      ~Section() { slot->sequence.store(sequence, std::memory_order_release); }
+      Slot *slot;
+      quint64 sequence;
+    };
+    HFBiConcurrentMap<Key, Value, Map> *m_map;
+    Slot *m_slot;
+  };
+
+  HFBiConcurrentMap(): m_current(new Map()) { }
+  explicit HFBiConcurrentMap(const Map &map): m_current(new Map(map)) { }
+  ~HFBiConcurrentMap()
+  {
+    delete m_current.load(std::memory_order_relaxed);
+    for(auto it=m_slots.constBegin();it!=m_slots.constEnd();++it)
+    {
+      (*it)->~Slot();
+      qFreeAligned(*it);
+    }
+  }
+
+  inline Reader reader() { return Reader(*this); }
+
+  // Functions below are meant for the writers; publish and update calls from different threads are serialized, so no batch of
+  // update is lost, but the version returned by current() may be replaced before it is published
+
+  // Copy of the current version, to be modified and published
+  inline Map current() const
+  {
+    QMutexLocker lock(&m_writeMutex);
+    return *m_current.load(std::memory_order_relaxed);
+  }
+  // Makes map the current version. Returns when no reader can still be using the previous one, which is then destroyed.
+  void publish(Map map)
+  {
+    QMutexLocker lock(&m_updateMutex);
+    replace(std::move(map));
+  }
+  // Applies a batch of modifications to a copy of the current version (f takes a Map &) and publishes the result. The writer lock is
+  // held throughout, so f must not call publish or update.
+  template <class F> void update(F f)
+  {
+    QMutexLocker lock(&m_updateMutex);
+    Map map=current();
+    f(map);
+    replace(std::move(map));
+  }
+private:
+  HFBiConcurrentMap(const HFBiConcurrentMap<Key, Value, Map> &) = delete;
+  HFBiConcurrentMap<Key, Value, Map> &operator=(const HFBiConcurrentMap<Key, Value, Map> &) = delete;
+  // Swaps map in, then waits for the readers of the previous version; called with m_updateMutex held
+  void replace(Map map)
+  {
+    Map *old;
+    {
+      QMutexLocker lock(&m_writeMutex);
+      old=m_current.load(std::memory_order_relaxed);
+      m_current.store(new Map(std::move(map)), std::memory_order_seq_cst);
+    }
+    // Readers whose lookup started before the store may still be using old: wait for each of them to move on. Slots registered
+    // after this point can only see the new version.
+    QList<Slot *> slots;
+    {
+      QMutexLocker lock(&m_slotMutex);
+      slots=m_slots;
+    }
+    for(auto it=slots.constBegin();it!=slots.constEnd();++it)
+    {
+      quint64 sequence=(*it)->sequence.load(std::memory_order_seq_cst);
+      if(sequence&1)
+      {
+        while((*it)->sequence.load(std::memory_order_acquire)==sequence)
+          QThread::yieldCurrentThread();
+      }
+    }
+    delete old;
+  }
+  Slot *registerSlot()
+  {
+    QMutexLocker lock(&m_slotMutex);
+    for(auto it=m_slots.constBegin();it!=m_slots.constEnd();++it)
+    {
+      if(!(*it)->used)
+      {
+        (*it)->used=true;
+        return *it;
+      }
+    }
+    // Plain new only guarantees the alignment of the fundamental types before C++17
+    m_slots.append(new(qMallocAligned(sizeof(Slot), alignof(Slot))) Slot());
+    return m_slots.last();
+  }
+  inline void unregisterSlot(Slot *slot)
+  {
+    QMutexLocker lock(&m_slotMutex);
+    slot->used=false;
+  }
+
+  std::atomic<Map *> m_current;
+  // Serializes the writers, from the copy of the current version to the end of the wait for readers. Readers never take it.
+  QMutex m_updateMutex;
+  // Guards the swap of m_current against current(); never held while waiting for readers
+  mutable QMutex m_writeMutex;
+  // Guards m_slots, which are never freed before the map
+  QMutex m_slotMutex;
+  QList<Slot *> m_slots;
+};
+
+#endif // HFBiConcurrentMap_Header
@@ -0,0 +1,316 @@
+/*
+ * Copyright 2021 Marzocchi Alessandro
+ * All rights reserved. Distributed under the terms of the MIT license.
+ */
+
+#ifndef HFBiDenseMap_Header
+#define HFBiDenseMap_Header
+
+#include <QPair>
+#include <QSharedDataPointer>
+#include <QtAlgorithms>
+#include <QVector>
+#include <algorithm>
+#include <initializer_list>
+#include <limits>
+#include <type_traits>
+#include <hfbimap.h>
+
+// One side of a HFBiDenseMap: the integers from base on, each one a slot holding what it maps to, with a bitmap of the slots in use
+template <class T, class Other> struct HFBiDenseIndex
+{
+  // Slots of a side when it starts, and the most it can have, i.e. the widest range of integers it can span: as many as a QVector can
+  // hold, its allocation (header included, allowed 64 bytes here) being limited to INT_MAX bytes
+  enum { MinimumSlots=64, MaximumSlots=(std::numeric_limits<int>::max()-64)/sizeof(Other) };
+  T base=T();
+  QVector<Other> other;
+  QVector<quint64> present;
+  // Integers shifted so that the smallest one is 0, which keeps their order for signed types as well
+  static inline quint64 offset(T x) { return quint64(x)-quint64(std::numeric_limits<T>::min()); }
+  static inline T integer(quint64 offset) { return T(offset+quint64(std::numeric_limits<T>::min())); }
+  inline int slots() const { return other.size(); }
+  inline T at(int slot) const { return integer(offset(base)+quint64(slot)); }
+  // Slot of x, or -1 if it is out of the range
+  inline int slot(T x) const
+  {
+    quint64 o=offset(x), b=offset(base);
+    return o<b || o-b>=quint64(slots())?-1:int(o-b);
+  }
+  inline bool has(int slot) const { return slot>=0 && (present.at(slot>>6)>>(slot&63))&1; }
+  inline void set(int slot, const Other &o)
+  {
+    other[slot]=o;
+    present[slot>>6]|=quint64(1)<<(slot&63);
+  }
+  inline void unset(int slot) { present[slot>>6]&=~(quint64(1)<<(slot&63)); }
+  // First slot in use from slot on, slots() if there is none
+  int next(int slot) const
+  {
+    int n=slots();
+    if(slot>=n)
+      return n;
+    int w=slot>>6;
+    quint64 word=present.at(w)&(~quint64(0)<<(slot&63));
+    while(!word)
+    {
+      if(++w>=present.size())
+        return n;
+      word=present.at(w);
+    }
+    return (w<<6)+int(qCountTrailingZeroBits(word));
+  }
+  // First slot in use holding an integer not less than x (greater than x if upper is set)
+  int bound(T x, bool upper) const
+  {
+    quint64 o=offset(x), b=offset(base);
+    if(o<b)
+      return next(0);
+    quint64 s=o-b+(upper?1:0);
+    return s>=quint64(slots())?slots():next(int(s));
+  }
+  // Range of offsets to grow to so that it includes x: it then doubles at least, so that filling it takes amortized constant time.
+  // False if that would take more than MaximumSlots
+  bool grown(T x, quint64 &low, quint64 &high) const
+  {
+    quint64 o=offset(x), last=offset(std::numeric_limits<T>::max());
+    quint64 count=MinimumSlots;
+    bool below=false;
+    low=high=o;
+    if(!other.isEmpty())
+    {
+      below=o<offset(base);
+      low=qMin(o, offset(base));
+      high=qMax(o, offset(base)+quint64(slots())-1);
+      if(high-low>=quint64(MaximumSlots))
+        return false;
+      count=qMax(high-low+1, qMin<quint64>(2*quint64(slots()), MaximumSlots));
+    }
+    // The spare room goes on the side x was added to, or on the other one where the integers run out
+    if(below)
+      low=high-qMin(count-1, high);
+    high=low+qMin(count-1, last-low);
+    low=high-qMin(count-1, high);
+    return true;
+  }
+  inline bool fits(T x) const { quint64 low, high; return slot(x)>=0 || grown(x, low, high); }
+  // Slot of x, growing the range to include it; -1 if the range can't grow that far
+  int make(T x)
+  {
+    int ret=slot(x);
+    quint64 low, high;
+    if(ret>=0 || !grown(x, low, high))
+      return ret;
+    resize(integer(low), int(high-low+1));
+    return slot(x);
+  }
+  void resize(T newBase, int count)
+  {
+    HFBiDenseIndex<T, Other> ret;
+    ret.base=newBase;
+    ret.other.resize(count);
+    ret.present.resize((count+63)/64);
+    for(int i=next(0);i<slots();i=next(i+1))
+      ret.set(ret.slot(at(i)), other.at(i));
+    *this=ret;
+  }
+};
+
+template <class Key, class Value> struct HFBiDenseMapData: public QSharedData
+{
+  HFBiDenseMapData(): size(0), id(0) { }
+  // Value and id of each key, and key of each value
+  HFBiDenseIndex<Key, QPair<Value, quint64> > forward;
+  HFBiDenseIndex<Value, Key> reverse;
+  int size;
+  quint64 id;
+};
+
+/** Counterpart of HFBiMap for integer keys and values, both taken from dense ranges (e.g. slot numbers mapped to handles). Each direction
+ * is an array indexed by the key (value) minus the smallest one, with a bitmap telling which slots are in use, so a lookup is a single
+ * array access and entries take no allocation of their own. Memory is proportional to the extent of the ranges, not to the number of
+ * entries, so sparse keys or values are better kept in a HFBiMap. Each side spans at most as many consecutive integers as a QVector
+ * of its slots can hold (see HFBiDenseIndex::MaximumSlots: about 2^27 keys and 2^29 values for an int to int map): an insert
+ * that would widen either range beyond that is refused and returns false.
+ * As in HFBiMap, each key and each value is held by one entry at most (insert removes the clashing ones), and iteration follows
+ * the order of keys, or of values. Iterators are invalidated by insertions.
+ */
+template <class Key, class Value> class HFBiDenseMap
+{
+  static_assert(std::is_integral<Key>::value && std::is_integral<Value>::value, "HFBiDenseMap needs integer keys and values");
+public:
+  class const_iterator
+  {
+    friend class HFBiDenseMap<Key,Value>;
+  protected:
+    const HFBiDenseMapData<Key,Value> *m_d;
+    bool m_isForward;
+    int m_pos;
+    inline int slots() const { return m_isForward?m_d->forward.slots():m_d->reverse.slots(); }
+  public:
+    inline const_iterator(const HFBiDenseMapData<Key,Value> *d, bool isForward, int pos): m_d(d), m_isForward(isForward), m_pos(pos) { }
+
+    inline Key key() const { return m_isForward?m_d->forward.at(m_pos):m_d->reverse.other.at(m_pos); }
+    inline Value value() const { return m_isForward?m_d->forward.other.at(m_pos).first:m_d->reverse.at(m_pos); }
+    inline qint64 id() const { return m_d->forward.other.at(m_isForward?m_pos:m_d->forward.slot(key())).second; }
+
+    inline bool operator!=(const const_iterator &o) const {
+      return !(*this==o);
+    }
+    // As with HFBiMap, end() and endValue() compare equal
+    inline bool operator==(const const_iterator &o) const {
+      return (m_pos==o.m_pos && m_isForward==o.m_isForward) || (m_pos>=slots() && o.m_pos>=o.slots());
+    }
+
+    inline const_iterator &operator++() { m_pos=m_isForward?m_d->forward.next(m_pos+1):m_d->reverse.next(m_pos+1); return *this; }
+    inline const_iterator operator++(int) { const_iterator r=*this; ++*this; return r; }
+  };
+  // Entries can't be modified in place, so all the iterators are constant
+  typedef const_iterator iterator;
+
+  HFBiDenseMap(): m_data(new HFBiDenseMapData<Key,Value>()) { }
+  inline HFBiDenseMap(std::initializer_list<std::pair<Key,Value> > list): HFBiDenseMap()
+  {
+    for(auto it=list.begin();it!=list.end();++it)
+      insert(it->first, it->second);
+  }
+  // Copy of a map, in the order its entries were added; entries that would exceed the range limit are left out, as insert does
+  template <class Storage> explicit HFBiDenseMap(const HFBiMap<Key, Value, Storage> &map): HFBiDenseMap()
+  {
+    QVector<typename HFBiMap<Key, Value, Storage>::const_iterator> entries;
+    entries.reserve(map.size());
+    for(auto it=map.constBegin();it!=map.constEnd();++it)
+      entries.append(it);
+    std::sort(entries.begin(), entries.end(), [](const typename HFBiMap<Key, Value, Storage>::const_iterator &a, const typename HFBiMap<Key, Value, Storage>::const_iterator &b) { return a.id()<b.id(); });
+    for(auto it=entries.constBegin();it!=entries.constEnd();++it)
+      insert(it->key(), it->value());
+  }
+
+  inline const_iterator begin() const { return constBegin(); }
+  inline const_iterator cbegin() const { return constBegin(); }
+  inline const_iterator beginValue() const { return constBeginValue(); }
+  inline const_iterator cbeginValue() const { return constBeginValue(); }
+  inline void clear() { m_data=new HFBiDenseMapData<Key,Value>(); }
+  inline bool contains(const Key &key) const { return m_data->forward.has(m_data->forward.slot(key)); }
+  inline bool containsValue(const Value &value) const { return m_data->reverse.has(m_data->reverse.slot(value)); }
+  inline const_iterator constBegin() const { return const_iterator(m_data.constData(), true, m_data->forward.next(0)); }
+  inline const_iterator constBeginValue() const { return const_iterator(m_data.constData(), false, m_data->reverse.next(0)); }
+  inline const_iterator constEnd() const { return const_iterator(m_data.constData(), true, m_data->forward.slots()); }
+  inline const_iterator constEndValue() const { return const_iterator(m_data.constData(), false, m_data->reverse.slots()); }
+  inline int count() const { return size(); }
+  inline int count(const Key &key) const { return contains(key)?1:0; }
+  inline int countValue(const Value &value) const { return containsValue(value)?1:0; }
+  inline bool empty() const { return isEmpty(); }
+  inline const_iterator end() const { return constEnd(); }
+  inline const_iterator cend() const { return constEnd(); }
+  inline const_iterator endValue() const { return constEndValue(); }
+  inline const_iterator cendValue() const { return constEndValue(); }
+  // Removes the entry at pos, returning the iterator to the next one in the same order
+  const_iterator erase(const_iterator pos)
+  {
+    if(pos==constEnd())
+      return pos;
+    int slot=pos.m_pos;
+    unlink(pos.key(), pos.value());
+    auto d=m_data.constData();
+    return const_iterator(d, pos.m_isForward, pos.m_isForward?d->forward.next(slot):d->reverse.next(slot));
+  }
+  inline const_iterator find(const Key &key) const { return findConst(key); }
+  inline const_iterator findConst(const Key &key) const
+  {
+    int slot=m_data->forward.slot(key);
+    return m_data->forward.has(slot)?const_iterator(m_data.constData(), true, slot):constEnd();
+  }
+  inline const_iterator findValue(const Value &value) const { return findValueConst(value); }
+  inline const_iterator findValueConst(const Value &value) const
+  {
+    int slot=m_data->reverse.slot(value);
+    return m_data->reverse.has(slot)?const_iterator(m_data.constData(), false, slot):constEnd();
+  }
+  // Removes the entries holding key or value, then adds the new one. Returns false, leaving the map untouched, if either
+  // side would have to span more than HFBiDenseIndex::MaximumSlots integers
+  bool insert(const Key &key, const Value &value)
+  {
+    if(!m_data->forward.fits(key) || !m_data->reverse.fits(value))
+      return false;
+    remove(key);
+    removeValue(value);
+    HFBiDenseMapData<Key,Value> *d=m_data.data();
+    d->forward.set(d->forward.make(key), qMakePair(value, ++d->id));
+    d->reverse.set(d->reverse.make(value), key);
+    d->size++;
+    return true;
+  }
+  inline bool isEmpty() const { return size()==0; }
+  inline const Key key(const Value &value, const Key &defaultKey = Key()) const
+  {
+    int slot=m_data->reverse.slot(value);
+    return m_data->reverse.has(slot)?m_data->reverse.other.at(slot):defaultKey;
+  }
+  inline QList<Key> keys() const { QList<Key> ret; ret.reserve(size()); for(auto it=constBegin();it!=constEnd();++it) ret.append(it.key()); return ret; }
+  inline const_iterator lowerBound(const Key &key) const { return const_iterator(m_data.constData(), true, m_data->forward.bound(key, false)); }
+  inline const_iterator lowerBoundValue(const Value &value) const { return const_iterator(m_data.constData(), false, m_data->reverse.bound(value, false)); }
+  inline int remove(const Key &key)
+  {
+    int slot=m_data->forward.slot(key);
+    if(!m_data->forward.has(slot))
+      return 0;
+    unlink(key, m_data->forward.other.at(slot).first);
+    return 1;
+  }
+  inline int removeValue(const Value &value)
+  {
+    int slot=m_data->reverse.slot(value);
+    if(!m_data->reverse.has(slot))
+      return 0;
+    unlink(m_data->reverse.other.at(slot), value);
+    return 1;
+  }
+  inline int size() const { return m_data->size; }
+  inline void swap(HFBiDenseMap<Key, Value> &other) { m_data.swap(other.m_data); }
+  Value take(const Key &key, const Value &defaultValue=Value())
+  {
+    auto it=find(key);
+    if(it!=end()) { auto ret=it.value(); erase(it); return ret;}
+    return defaultValue;
+  }
+  Key takeValue(const Value &value, const Key &defaultKey=Key())
+  {
+    auto it=findValue(value);
+    if(it!=end()) { auto ret=it.key(); erase(it); return ret;}
+    return defaultKey;
+  }
+  inline const_iterator upperBound(const Key &key) const { return const_iterator(m_data.constData(), true, m_data->forward.bound(key, true)); }
+  inline const_iterator upperBoundValue(const Value &value) const { return const_iterator(m_data.constData(), false, m_data->reverse.bound(value, true)); }
+  inline const Value value(const Key &key, const Value &defaultValue = Value()) const
+  {
+    int slot=m_data->forward.slot(key);
+    return m_data->forward.has(slot)?m_data->forward.other.at(slot).first:defaultValue;
+  }
+  inline QList<Value> values() const { QList<Value> ret; ret.reserve(size()); for(auto it=constBeginValue();it!=constEndValue();++it) ret.append(it.value()); return ret; }
+  inline bool operator==(const HFBiDenseMap<Key, Value> &other) const {
+    if(m_data==other.m_data) // Easy case
+      return true;
+    if(size()!=other.size())
+      return false;
+    for(auto it=constBegin(), it2=other.constBegin();it!=constEnd();++it, ++it2)
+    {
+      if(it.key()!=it2.key() || it.value()!=it2.value())
+        return false;
+    }
+    return true;
+  }
+  inline bool operator!=(const HFBiDenseMap<Key, Value> &other) const { return !(*this==other); }
+protected:
+  QSharedDataPointer<HFBiDenseMapData<Key, Value> > m_data;
+
+  // Frees the slots of an entry
+  inline void unlink(const Key &key, const Value &value)
+  {
+    HFBiDenseMapData<Key,Value> *d=m_data.data();
+    d->forward.unset(d->forward.slot(key));
+    d->reverse.unset(d->reverse.slot(value));
+    d->size--;
+  }
+};
+
+#endif // HFBiDenseMap_Header
@@ -0,0 +1,378 @@
+/*
+ * Copyright 2021 Marzocchi Alessandro
+ * All rights reserved. Distributed under the terms of the MIT license.
+ */
+
+#ifndef HFBiFlatMap_Header
+#define HFBiFlatMap_Header
+
+#include <QSharedDataPointer>
+#include <QVector>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <hfbimap.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+#define HFBiFlatMap_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Counts the elements of a block (a cache line of integers) which are less than x, or greater than x. This portable version is a
+// loop without branches; on x86 the blocks of 32 and 64 bit integers are compared a vector at a time.
+template <class T, int Bytes = sizeof(T)> struct HFBiFlatBlock
+{
+  enum { Size=64/Bytes };
+  static inline int less(const T *block, T x)
+  {
+    int ret=0;
+    for(int i=0;i<Size;i++)
+      ret+=block[i]<x;
+    return ret;
+  }
+  static inline int greater(const T *block, T x)
+  {
+    int ret=0;
+    for(int i=0;i<Size;i++)
+      ret+=block[i]>x;
+    return ret;
+  }
+};
+#ifdef HFBiFlatMap_SSE2
+// Unsigned integers are compared as signed ones once their top bit is flipped
+template <class T> struct HFBiFlatBlock<T, 4>
+{
+  enum { Size=16 };
+  static inline int less(const T *block, T x) { return count(block, x, true); }
+  static inline int greater(const T *block, T x) { return count(block, x, false); }
+private:
+  static inline int count(const T *block, T x, bool lessThan)
+  {
+    const int bias=std::is_signed<T>::value?0:int(0x80000000u);
+#ifdef __AVX2__
+    __m256i key=_mm256_set1_epi32(int(x)^bias), flip=_mm256_set1_epi32(bias), sum=_mm256_setzero_si256();
+    for(int i=0;i<Size;i+=8)
+    {
+      __m256i v=_mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(block+i)), flip);
+      // Matching lanes are all ones, i.e. -1
+      sum=_mm256_sub_epi32(sum, lessThan?_mm256_cmpgt_epi32(key, v):_mm256_cmpgt_epi32(v, key));
+    }
+    __m128i half=_mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+#else
+    __m128i key=_mm_set1_epi32(int(x)^bias), flip=_mm_set1_epi32(bias), half=_mm_setzero_si128();
+    for(int i=0;i<Size;i+=4)
+    {
+      __m128i v=_mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(block+i)), flip);
+      half=_mm_sub_epi32(half, lessThan?_mm_cmpgt_epi32(key, v):_mm_cmpgt_epi32(v, key));
+    }
+#endif
+    half=_mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+    half=_mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(half);
+  }
+};
+#endif
+#if defined(HFBiFlatMap_SSE2) && defined(__SSE4_2__)
+// 64 bit comparisons need SSE 4.2
+template <class T> struct HFBiFlatBlock<T, 8>
+{
+  enum { Size=8 };
+  static inline int less(const T *block, T x) { return count(block, x, true); }
+  static inline int greater(const T *block, T x) { return count(block, x, false); }
+private:
+  static inline int count(const T *block, T x, bool lessThan)
+  {
+    const long long bias=std::is_signed<T>::value?0:(long long)0x8000000000000000ull;
+#ifdef __AVX2__
+    __m256i key=_mm256_set1_epi64x((long long)x^bias), flip=_mm256_set1_epi64x(bias), sum=_mm256_setzero_si256();
+    for(int i=0;i<Size;i+=4)
+    {
+      __m256i v=_mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(block+i)), flip);
+      sum=_mm256_sub_epi64(sum, lessThan?_mm256_cmpgt_epi64(key, v):_mm256_cmpgt_epi64(v, key));
+    }
+    __m128i half=_mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+#else
+    __m128i key=_mm_set1_epi64x((long long)x^bias), flip=_mm_set1_epi64x(bias), half=_mm_setzero_si128();
+    for(int i=0;i<Size;i+=2)
+    {
+      __m128i v=_mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(block+i)), flip);
+      half=_mm_sub_epi64(half, lessThan?_mm_cmpgt_epi64(key, v):_mm_cmpgt_epi64(v, key));
+    }
+#endif
+    half=_mm_add_epi64(half, _mm_unpackhi_epi64(half, half));
+    return _mm_cvtsi128_si32(half);
+  }
+};
+#endif
+
+/** Static search tree over a sorted array of integers (an implicit B+ tree). The array is cut into blocks of a cache line, and each
+ * upper level holds the largest element of every block of the level below, again cut into blocks, up to a single root block. A search
+ * reads one block per level, comparing it with x at once (see HFBiFlatBlock): for 10M int keys that is 6 blocks, instead of the
+ * 23 reads scattered over the array of a binary search. The tree keeps a copy of the array, padded to whole blocks.
+ * Other types have an empty tree, and are searched by binary search instead.
+ */
+template <class T, bool Enabled = std::is_integral<T>::value && !std::is_same<T, bool>::value> struct HFBiFlatIndex
+{
+  typedef HFBiFlatBlock<T> Block;
+  // Blocks of all the levels, the leaves first
+  QVector<T> blocks;
+  // First block of each level and number of blocks in it
+  QVector<int> starts, counts;
+  int size=0;
+  inline bool isEmpty() const { return blocks.isEmpty(); }
+  // Builds the tree over the n elements at(0)...at(n-1), which must be sorted
+  template <class At> void build(int n, const At &at)
+  {
+    const int B=Block::Size;
+    blocks.clear();
+    starts.clear();
+    counts.clear();
+    size=n;
+    int count=(n+B-1)/B;
+    blocks.reserve(count*B+count*B/(B-1)+B);
+    for(int i=0;i<count*B;i++)
+      blocks.append(i<n?at(i):std::numeric_limits<T>::max());
+    starts.append(0);
+    counts.append(count);
+    while(count>1)
+    {
+      int below=starts.last(), belowCount=count;
+      count=(count+B-1)/B;
+      starts.append(blocks.size()/B);
+      counts.append(count);
+      // Padding holds the largest integer, so the last element of a block is the largest of its subtree
+      for(int i=0;i<count*B;i++)
+      {
+        T largest=i<belowCount?blocks.at((below+i)*B+B-1):std::numeric_limits<T>::max();
+        blocks.append(largest);
+      }
+    }
+  }
+  // Position of the first element not less than x, or greater than x if upper is set
+  inline int bound(T x, bool upper) const
+  {
+    const int B=Block::Size;
+    const T *data=blocks.constData();
+    int node=0;
+    for(int level=starts.size()-1;level>=0;level--)
+    {
+      const T *block=data+(starts.at(level)+node)*B;
+      node=node*B+(upper?B-Block::greater(block, x):Block::less(block, x));
+      // Past the last subtree: every element comes before x
+      if(level>0 && node>=counts.at(level-1))
+        return size;
+    }
+    return qMin(node, size);
+  }
+};
+template <class T> struct HFBiFlatIndex<T, false>
+{
+  inline bool isEmpty() const { return true; }
+  template <class At> inline void build(int, const At &) { }
+  inline int bound(const T &, bool) const { return 0; }
+};
+
+template <class Key, class Value> struct HFBiFlatMapData: public QSharedData
+{
+  // Entries sorted as the forward index of HFBiMap (by key, latest id first among equal keys).
+  // Keys are kept in an array of their own, so a forward search only touches contiguous keys.
+  QVector<Key> keys;
+  QVector<Value> values;
+  QVector<quint64> ids;
+  // Positions in the arrays above, sorted as the reverse index of HFBiMap
+  QVector<int> byValue;
+  // Id counter of the map the entries come from
+  quint64 id;
+  // Search trees over keys and values in index order, only for integers
+  HFBiFlatIndex<Key> keyIndex;
+  HFBiFlatIndex<Value> valueIndex;
+  // Builds the search trees once the arrays above are filled
+  void index()
+  {
+    keyIndex.build(keys.size(), [this](int i) { return keys.at(i); });
+    valueIndex.build(byValue.size(), [this](int i) { return values.at(byValue.at(i)); });
+  }
+};
+
+/** Read-only counterpart of HFBiMap for tables that are seldom modified: entries are kept in contiguous arrays and looked up by binary search,
+ * avoiding the pointer chasing of the node based QMap. Integer keys and values are looked up in a cache friendly search tree instead,
+ * see HFBiFlatIndex.
+ * It is obtained with HFBiMap::freeze() (or constructed from any HFBiMap/HFBiMultiMap) and turned back into a mutable map with thaw().
+ * find/findValue/lowerBound/upperBound and iteration follow the same ordering as HFBiMap, including entries sharing the same key or value.
+ */
+template <class Key, class Value> class HFBiFlatMap
+{
+public:
+  class const_iterator
+  {
+    friend class HFBiFlatMap<Key,Value>;
+  protected:
+    const HFBiFlatMapData<Key,Value> *m_d;
+    bool m_isForward;
+    int m_pos;
+    inline int entry() const { return m_isForward?m_pos:m_d->byValue.at(m_pos); }
+  public:
+    inline const_iterator(const HFBiFlatMapData<Key,Value> *d, bool isForward, int pos): m_d(d), m_isForward(isForward), m_pos(pos) { }
+
+    inline const Key &key() const { return m_d->keys.at(entry()); }
+    inline const Value &value() const { return m_d->values.at(entry()); }
+    inline qint64 id() const { return m_d->ids.at(entry()); }
+
+    inline bool operator!=(const const_iterator &o) const {
+      return !(*this==o);
+    }
+    // As with HFBiMap, end() and endValue() compare equal
+    inline bool operator==(const const_iterator &o) const {
+      int n=m_d->keys.size();
+      return m_pos==o.m_pos && (m_isForward==o.m_isForward || m_pos==n);
+    }
+
+    inline const_iterator &operator++() { m_pos++; return *this; }
+    inline const_iterator operator++(int) { const_iterator r=*this; m_pos++; return r; }
+    inline const_iterator &operator--() { m_pos--; return *this; }
+    inline const_iterator operator--(int) { const_iterator r=*this; m_pos--; return r; }
+    inline const_iterator operator+(int j) const { auto r=*this; r.m_pos+=j; return r; }
+    inline const_iterator operator-(int j) const { auto r=*this; r.m_pos-=j; return r; }
+    inline const_iterator &operator+=(int j) { m_pos+=j; return *this; }
+    inline const_iterator &operator-=(int j) { m_pos-=j; return *this; }
+  };
+  // The map can't be modified, so all the iterators are constant
+  typedef const_iterator iterator;
+
+  HFBiFlatMap(): m_data(new HFBiFlatMapData<Key,Value>()) { m_data->id=0; }
+  template <class Storage> explicit HFBiFlatMap(const HFBiMap<Key, Value, Storage> &map): m_data(new HFBiFlatMapData<Key,Value>())
+  {
+    HFBiFlatMapData<Key,Value> *d=m_data.data();
+    int n=map.size();
+    d->keys.reserve(n);
+    d->values.reserve(n);
+    d->ids.reserve(n);
+    d->id=map.m_data->id;
+    for(auto it=map.constBegin();it!=map.constEnd();++it)
+    {
+      d->keys.append(it.key());
+      d->values.append(it.value());
+      d->ids.append(it.id());
+    }
+    d->byValue.resize(n);
+    for(int i=0;i<n;i++)
+      d->byValue[i]=i;
+    // Same order as qMapLessThanKey on HFBiMapFirst
+    std::sort(d->byValue.begin(), d->byValue.end(), [d](int a, int b) {
+      return qMapLessThanKey(d->values.at(a), d->values.at(b)) || (!qMapLessThanKey(d->values.at(b), d->values.at(a)) && d->ids.at(a)>d->ids.at(b));
+    });
+    d->index();
+  }
+
+  // Entry at position i in the order of keys (at) or values (atValue), end() if there is none
+  inline const_iterator at(int i) const { return const_iterator(m_data.constData(), true, i<0 || i>size()?size():i); }
+  inline const_iterator atValue(int i) const { return const_iterator(m_data.constData(), false, i<0 || i>size()?size():i); }
+  inline const_iterator begin() const { return constBegin(); }
+  inline const_iterator cbegin() const { return constBegin(); }
+  inline const_iterator beginValue() const { return constBeginValue(); }
+  inline const_iterator cbeginValue() const { return constBeginValue(); }
+  inline bool contains(const Key &key) const { return findConst(key)!=constEnd(); }
+  inline bool containsValue(const Value &value) const { return findValueConst(value)!=constEnd(); }
+  inline const_iterator constBegin() const { return const_iterator(m_data.constData(), true, 0); }
+  inline const_iterator constBeginValue() const { return const_iterator(m_data.constData(), false, 0); }
+  inline const_iterator constEnd() const { return const_iterator(m_data.constData(), true, size()); }
+  inline const_iterator constEndValue() const { return const_iterator(m_data.constData(), false, size()); }
+  inline int count() const { return size(); }
+  inline int count(const Key &key) const { return keyUpper(key)-keyLower(key); }
+  inline int countValue(const Value &value) const { return valueUpper(value)-valueLower(value); }
+  inline bool empty() const { return isEmpty(); }
+  inline const_iterator end() const { return constEnd(); }
+  inline const_iterator cend() const { return constEnd(); }
+  inline const_iterator endValue() const { return constEndValue(); }
+  inline const_iterator cendValue() const { return constEndValue(); }
+  inline const_iterator find(const Key &key) const { return findConst(key); }
+  inline const_iterator findConst(const Key &key) const
+  {
+    int pos=keyLower(key);
+    return pos<size() && !qMapLessThanKey(key, m_data->keys.at(pos))?const_iterator(m_data.constData(), true, pos):constEnd();
+  }
+  inline const_iterator findValue(const Value &value) const { return findValueConst(value); }
+  inline const_iterator findValueConst(const Value &value) const
+  {
+    int pos=valueLower(value);
+    return pos<size() && !qMapLessThanKey(value, m_data->values.at(m_data->byValue.at(pos)))?const_iterator(m_data.constData(), false, pos):constEnd();
+  }
+  inline const Key &firstKey() const { return m_data->keys.first(); }
+  inline const Value &firstValue() const { return m_data->values.at(m_data->byValue.first()); }
+  inline bool isEmpty() const { return m_data->keys.isEmpty(); }
+  inline const Key key(const Value &value, const Key &defaultKey = Key()) const
+  {
+    auto it=findValueConst(value);
+    return it!=constEnd()?it.key():defaultKey;
+  }
+  inline QList<Key> keys() const { QList<Key> ret; ret.reserve(size()); for(auto it=m_data->keys.constBegin();it!=m_data->keys.constEnd();++it) ret.append(*it); return ret; }
+  inline const Key &last() const { return m_data->keys.last(); }
+  inline const Value &lastValue() const { return m_data->values.at(m_data->byValue.last()); }
+  inline const_iterator lowerBound(const Key &key) const { return const_iterator(m_data.constData(), true, keyLower(key)); }
+  inline const_iterator lowerBoundValue(const Value &value) const { return const_iterator(m_data.constData(), false, valueLower(value)); }
+  // Number of entries whose key (value) is less than key (value), i.e. the position of lowerBound (lowerBoundValue)
+  inline int rank(const Key &key) const { return keyLower(key); }
+  inline int rankValue(const Value &value) const { return valueLower(value); }
+  inline int size() const { return m_data->keys.size(); }
+  inline void swap(HFBiFlatMap<Key, Value> &other) { m_data.swap(other.m_data); }
+  // Mutable copy of the map, keeping entry ids. Map can be any HFBiMap or HFBiMultiMap with the same Key and Value; its entries are
+  // created by the storage of ret, e.g. a map constructed with an allocator.
+  template <class Map = HFBiMap<Key, Value> > Map thaw(Map ret = Map()) const
+  {
+    ret.thawFrom(*this);
+    return ret;
+  }
+  inline const_iterator upperBound(const Key &key) const { return const_iterator(m_data.constData(), true, keyUpper(key)); }
+  inline const_iterator upperBoundValue(const Value &value) const { return const_iterator(m_data.constData(), false, valueUpper(value)); }
+  inline const Value value(const Key &key, const Value &defaultValue = Value()) const
+  {
+    auto it=findConst(key);
+    return it!=constEnd()?it.value():defaultValue;
+  }
+  inline QList<Value> values() const { QList<Value> ret; ret.reserve(size()); for(auto it=m_data->byValue.constBegin();it!=m_data->byValue.constEnd();++it) ret.append(m_data->values.at(*it)); return ret; }
+  inline bool operator==(const HFBiFlatMap<Key, Value> &other) const {
+    if(m_data==other.m_data) // Easy case
+      return true;
+    return m_data->keys==other.m_data->keys && m_data->values==other.m_data->values;
+  }
+  inline bool operator!=(const HFBiFlatMap<Key, Value> &other) const { return !(*this==other); }
+protected:
+  template <class K, class V, class S> friend class HFBiMap;
+  template <class K, class V> friend class HFBiMappedMap;
+  QSharedDataPointer<HFBiFlatMapData<Key, Value> > m_data;
+
+  inline int keyLower(const Key &key) const
+  {
+    if(!m_data->keyIndex.isEmpty())
+      return m_data->keyIndex.bound(key, false);
+    return std::lower_bound(m_data->keys.constBegin(), m_data->keys.constEnd(), key, [](const Key &a, const Key &b) { return qMapLessThanKey(a, b); })-m_data->keys.constBegin();
+  }
+  inline int keyUpper(const Key &key) const
+  {
+    if(!m_data->keyIndex.isEmpty())
+      return m_data->keyIndex.bound(key, true);
+    return std::upper_bound(m_data->keys.constBegin(), m_data->keys.constEnd(), key, [](const Key &a, const Key &b) { return qMapLessThanKey(a, b); })-m_data->keys.constBegin();
+  }
+  inline int valueLower(const Value &value) const
+  {
+    const HFBiFlatMapData<Key,Value> *d=m_data.constData();
+    if(!d->valueIndex.isEmpty())
+      return d->valueIndex.bound(value, false);
+    return std::lower_bound(d->byValue.constBegin(), d->byValue.constEnd(), value, [d](int a, const Value &b) { return qMapLessThanKey(d->values.at(a), b); })-d->byValue.constBegin();
+  }
+  inline int valueUpper(const Value &value) const
+  {
+    const HFBiFlatMapData<Key,Value> *d=m_data.constData();
+    if(!d->valueIndex.isEmpty())
+      return d->valueIndex.bound(value, true);
+    return std::upper_bound(d->byValue.constBegin(), d->byValue.constEnd(), value, [d](const Value &a, int b) { return qMapLessThanKey(a, d->values.at(b)); })-d->byValue.constBegin();
+  }
+};
+
+#endif // HFBiFlatMap_Header
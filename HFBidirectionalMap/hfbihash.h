@@ -0,0 +1,512 @@
+/*
+ * Copyright 2021 Marzocchi Alessandro
+ * All rights reserved. Distributed under the terms of the MIT license.
+ */
+
+#ifndef HFBiHash_Header
+#define HFBiHash_Header
+
+#include <QHash>
+#include <QList>
+#include <QSharedDataPointer>
+#include <QVector>
+#include <algorithm>
+#include <initializer_list>
+#include <utility>
+
+// Key of a group of entries in a HFBiHash: points to the key (value) of one of them, as only the pointed data takes part in hashing and
+// equality. When that entry goes away the pointer is moved to an equal object, which leaves the hash untouched.
+template <class T> struct HFBiHashFirst {
+  constexpr HFBiHashFirst(const T *data): d(data) { }
+  constexpr operator const T*() {return d;}
+  mutable const T *d;
+};
+template <class T> inline bool operator==(const HFBiHashFirst<T> &key1, const HFBiHashFirst<T> &key2) { return *key1.d==*key2.d; }
+template <class T> inline uint qHash(const HFBiHashFirst<T> &key, uint seed=0) { return qHash(*key.d, seed); }
+
+// An entry of a HFBiHash, linked in the group of the entries sharing its key and in the one of those sharing its value, the most
+// recently inserted first. Index 0 of the links is for keys, 1 for values.
+template <class Key, class Value> struct HFBiHashNode
+{
+  inline HFBiHashNode(const Key &key, const Value &value, quint64 id): key(key), value(value), id(id)
+  {
+    next[0]=next[1]=prev[0]=prev[1]=nullptr;
+  }
+  Key key;
+  Value value;
+  quint64 id;
+  HFBiHashNode *next[2], *prev[2];
+};
+
+template <class Key, class Value> class HFBiMultiHash;
+template <class Key, class Value> struct HFBiHashData: public QSharedData
+{
+  typedef HFBiHashNode<Key, Value> Node;
+  HFBiHashData(): size(0), id(0) { }
+  HFBiHashData(const HFBiHashData<Key,Value> &base): size(0)
+  {
+    id=base.id;
+    // Entries are reinserted by increasing id so that entries sharing a key keep their most-recent-first order
+    QVector<const Node *> entries;
+    entries.reserve(base.size);
+    for(auto it=base.forward.constBegin();it!=base.forward.constEnd();++it)
+    {
+      for(const Node *node=it.value();node;node=node->next[0])
+        entries.append(node);
+    }
+    std::sort(entries.begin(), entries.end(), [](const Node *a, const Node *b) { return a->id<b->id; });
+    forward.reserve(base.forward.size());
+    reverse.reserve(base.reverse.size());
+    for(auto it=entries.constBegin();it!=entries.constEnd();++it)
+      link(new Node((*it)->key, (*it)->value, (*it)->id));
+  }
+  ~HFBiHashData() { clear(); }
+  // First entry of each group
+  QHash<HFBiHashFirst<Key>, Node *> forward;
+  QHash<HFBiHashFirst<Value>, Node *> reverse;
+  int size;
+  quint64 id;
+  void clear(){
+    for(auto it=forward.begin(); it!=forward.end(); it++)
+    {
+      for(Node *node=it.value();node;)
+      {
+        Node *next=node->next[0];
+        delete node;
+        node=next;
+      }
+    }
+    forward.clear();
+    reverse.clear();
+    size=0;
+  }
+  // Adds node in front of the groups of its key and of its value
+  inline void link(Node *node)
+  {
+    push(forward, &node->key, node, 0);
+    push(reverse, &node->value, node, 1);
+    size++;
+  }
+  // Takes node out of both groups, without searching either of them, and frees it
+  inline void unlink(Node *node)
+  {
+    pop(forward, &node->key, node, 0, node->next[0]?&node->next[0]->key:nullptr);
+    pop(reverse, &node->value, node, 1, node->next[1]?&node->next[1]->value:nullptr);
+    size--;
+    delete node;
+  }
+  // Puts node first in its group on side: the group key always points to the data of the first entry
+  template <class T> static inline void push(QHash<HFBiHashFirst<T>, Node *> &hash, const T *data, Node *node, int side)
+  {
+    auto it=hash.find(HFBiHashFirst<T>(data));
+    if(it==hash.end())
+    {
+      hash.insert(HFBiHashFirst<T>(data), node);
+      return;
+    }
+    node->next[side]=it.value();
+    it.value()->prev[side]=node;
+    it.value()=node;
+    it.key().d=data;
+  }
+  // Takes node out of its group on side; nextData is the key (value) of the entry following it in the group, if any
+  template <class T> static inline void pop(QHash<HFBiHashFirst<T>, Node *> &hash, const T *data, Node *node, int side, const T *nextData)
+  {
+    Node *next=node->next[side];
+    if(next)
+      next->prev[side]=node->prev[side];
+    if(node->prev[side])
+      node->prev[side]->next[side]=next;
+    else
+    {
+      // First of its group: the group now starts at next, whose data the group key points to from now on
+      auto it=hash.find(HFBiHashFirst<T>(data));
+      if(next)
+      {
+        it.key().d=nextData;
+        it.value()=next;
+      }
+      else
+        hash.erase(it);
+    }
+  }
+};
+
+/** Unordered counterpart of HFBiMap: both the Key->Value and the Value->Key association are kept in hash tables, so lookups in either
+ * direction take amortized constant time. Each entry is linked in the group of the entries sharing its key and in the one of those
+ * sharing its value, so erasing it also takes amortized constant time, however large the groups.
+ * Iteration order is unspecified; entries sharing the same key (or value) are visited from the most recently inserted one, as with QHash.
+ */
+template <class Key, class Value> class HFBiHash
+{
+  typedef HFBiHashNode<Key, Value> Node;
+public:
+  typedef HFBiHashFirst<Key> ForwardFirst;
+  typedef HFBiHashFirst<Value> ReverseFirst;
+
+  class const_iterator
+  {
+    friend class HFBiHash<Key,Value>;
+    friend class HFBiMultiHash<Key,Value>;
+  protected:
+    const HFBiHashData<Key,Value> *m_d;
+    bool m_isForward;
+    typename QHash<ForwardFirst, Node *>::const_iterator m_forwardIt;
+    typename QHash<ReverseFirst, Node *>::const_iterator m_reverseIt;
+    // Entry inside the group at m_forwardIt (m_reverseIt), null at the end
+    Node *m_node;
+  public:
+    inline const_iterator(const HFBiHashData<Key,Value> *d, bool isForward): m_d(d), m_isForward(isForward), m_node(nullptr) { }
+
+    inline const Key &key() const { return m_node->key; }
+    inline const Value &value() const { return m_node->value; }
+    inline qint64 id() const { return m_node->id; }
+
+    inline bool operator!=(const const_iterator &o) const {
+      return !(*this==o);
+    }
+    // Iterators on the same entry are equal whatever their direction, so end() and endValue() compare equal
+    inline bool operator==(const const_iterator &o) const {
+      return m_node==o.m_node;
+    }
+
+    inline const_iterator &operator++()
+    {
+      int side=m_isForward?0:1;
+      m_node=m_node->next[side];
+      if(!m_node)
+      {
+        if(m_isForward)
+          m_node=++m_forwardIt!=m_d->forward.constEnd()?m_forwardIt.value():nullptr;
+        else
+          m_node=++m_reverseIt!=m_d->reverse.constEnd()?m_reverseIt.value():nullptr;
+      }
+      return *this;
+    }
+    inline const_iterator operator++(int) { const_iterator r=*this; ++*this; return r; }
+  };
+  // Entries can't be modified in place, so all the iterators are constant
+  typedef const_iterator iterator;
+
+  HFBiHash(): m_data(new HFBiHashData<Key,Value>()) { }
+  HFBiHash(HFBiHash<Key, Value> &&other): m_data(new HFBiHashData<Key,Value>()) { swap(other); }
+  HFBiHash(const HFBiHash<Key, Value> &other) = default;
+  inline HFBiHash(std::initializer_list<std::pair<Key,Value> > list): m_data(new HFBiHashData<Key,Value>())
+  {
+    reserve(int(list.size()));
+    for (typename std::initializer_list<std::pair<Key,Value> >::const_iterator it = list.begin(); it != list.end(); ++it)
+      insert(it->first, it->second);
+  }
+  HFBiHash<Key, Value> &operator=(HFBiHash<Key, Value> &&other) { m_data.swap(other.m_data); return *this; }
+  HFBiHash<Key, Value> &operator=(const HFBiHash<Key, Value> &other) = default;
+
+  inline iterator begin() { return createForward(m_data->forward.constBegin()); }
+  inline const_iterator begin() const { return constBegin(); }
+  inline const_iterator cbegin() const { return constBegin(); }
+  inline iterator beginValue() { return createReverse(m_data->reverse.constBegin()); }
+  inline const_iterator beginValue() const { return constBeginValue(); }
+  inline const_iterator cbeginValue() const { return constBeginValue(); }
+  inline void clear() { m_data->clear(); }
+  inline bool contains(const Key &key) const { return m_data->forward.contains(ForwardFirst(&key)); }
+  inline bool containsValue(const Value &value) const { return m_data->reverse.contains(ReverseFirst(&value)); }
+  inline const_iterator constBegin() const { return createForward(m_data->forward.constBegin()); }
+  inline const_iterator constBeginValue() const { return createReverse(m_data->reverse.constBegin()); }
+  inline const_iterator constEnd() const { return createForward(m_data->forward.constEnd()); }
+  inline const_iterator constEndValue() const { return createReverse(m_data->reverse.constEnd()); }
+  inline int count() const {return size();}
+
+  inline bool empty() const { return isEmpty(); }
+  inline iterator end() { return createForward(m_data->forward.constEnd()); }
+  inline const_iterator end() const { return constEnd(); }
+  inline const_iterator cend() const { return constEnd(); }
+  inline iterator endValue() { return createReverse(m_data->reverse.constEnd()); }
+  inline const_iterator endValue() const { return constEndValue(); }
+  inline const_iterator cendValue() const { return constEndValue(); }
+  // Removes the entry at pos, returning the iterator to the next one in the same direction
+  iterator erase(iterator pos)
+  {
+    if(!pos.m_node)
+      return pos;
+    HFBiHashData<Key,Value> *d=m_data.data();
+    // The hash may have detached since pos was taken: pos is then found again in the copy
+    if(d!=pos.m_d)
+      pos=locate(pos.m_isForward, pos.m_node->key, pos.m_node->value, pos.m_node->id);
+    Node *node=pos.m_node;
+    if(pos.m_isForward) {
+      if(node->next[0] || node->prev[0])
+      {
+        // The group stays, so the position of the hash does too
+        pos.m_node=node->next[0];
+        if(!pos.m_node)
+          pos.m_node=++pos.m_forwardIt!=d->forward.constEnd()?pos.m_forwardIt.value():nullptr;
+        d->unlink(node);
+      }
+      else
+      {
+        // Alone with its key: the group goes away with it, and erasing it from the hash tells which group follows
+        d->pop(d->reverse, &node->value, node, 1, node->next[1]?&node->next[1]->value:nullptr);
+        pos.m_forwardIt=d->forward.erase(d->forward.find(ForwardFirst(&node->key)));
+        pos.m_node=pos.m_forwardIt!=d->forward.constEnd()?pos.m_forwardIt.value():nullptr;
+        d->size--;
+        delete node;
+      }
+    }
+    else {
+      if(node->next[1] || node->prev[1])
+      {
+        pos.m_node=node->next[1];
+        if(!pos.m_node)
+          pos.m_node=++pos.m_reverseIt!=d->reverse.constEnd()?pos.m_reverseIt.value():nullptr;
+        d->unlink(node);
+      }
+      else
+      {
+        d->pop(d->forward, &node->key, node, 0, node->next[0]?&node->next[0]->key:nullptr);
+        pos.m_reverseIt=d->reverse.erase(d->reverse.find(ReverseFirst(&node->value)));
+        pos.m_node=pos.m_reverseIt!=d->reverse.constEnd()?pos.m_reverseIt.value():nullptr;
+        d->size--;
+        delete node;
+      }
+    }
+    return pos;
+  }
+  inline iterator find(const Key &key) { return createForward(m_data->forward.constFind(ForwardFirst(&key))); }
+  inline const_iterator findConst(const Key &key) const { return createForward(m_data->forward.constFind(ForwardFirst(&key))); }
+  inline iterator findValue(const Value &value) { return createReverse(m_data->reverse.constFind(ReverseFirst(&value))); }
+  inline const_iterator findValueConst(const Value &value) const { return createReverse(m_data->reverse.constFind(ReverseFirst(&value))); }
+  inline void insert(const Key &key, const Value &value)
+  {
+    remove(key);
+    removeValue(value);
+    insertMulti(key, value);
+  }
+  // Allows multiple entries with same key to exist, but not multiple values
+  inline void insertMultiKey(const Key &key, const Value &value)
+  {
+    removeValue(value);
+    insertMulti(key, value);
+  }
+  // Allows multiple entries with same value to exist, but not multiple keys
+  inline void insertMultiValue(const Key &key, const Value &value)
+  {
+    remove(key);
+    insertMulti(key, value);
+  }
+  inline void insertMulti(const Key &key, const Value &value)
+  {
+    HFBiHashData<Key,Value> *d=m_data.data();
+    d->link(new Node(key, value, ++d->id));
+  }
+  inline bool isEmpty() const { return size()==0; }
+  inline const Key key(const Value &value, const Key &defaultKey = Key()) const
+  {
+    auto it=m_data->reverse.constFind(ReverseFirst(&value));
+    return it!=m_data->reverse.constEnd()?it.value()->key:defaultKey;
+  }
+  inline QList<Key> keys() const { QList<Key> ret; for(auto it=constBegin();it!=constEnd();++it) { ret.append(it.key()); } return ret; }
+  inline int remove(const Key &key) {
+    auto it=m_data->forward.constFind(ForwardFirst(&key));
+    if(it==m_data->forward.constEnd())
+      return 0;
+    return unlinkGroup(it.value(), 0);
+  }
+  inline int removeValue(const Value &value) {
+    auto it=m_data->reverse.constFind(ReverseFirst(&value));
+    if(it==m_data->reverse.constEnd())
+      return 0;
+    return unlinkGroup(it.value(), 1);
+  }
+  // Preallocates both hash tables for size entries
+  inline void reserve(int size) { m_data->forward.reserve(size); m_data->reverse.reserve(size); }
+  inline int size() const {return m_data->size;}
+  inline void swap(HFBiHash<Key, Value> &other) { m_data.swap(other.m_data); }
+  Value take(const Key &key, const Value &defaultValue=Value())
+  {
+    auto it=find(key);
+    if(it!=end()) { auto ret=it.value(); erase(it); return ret;}
+    return defaultValue;
+  }
+  Key takeValue(const Value &value, const Key &defaultKey=Key())
+  {
+    auto it=findValue(value);
+    if(it!=end()) { auto ret=it.key(); erase(it); return ret;}
+    return defaultKey;
+  }
+  inline const Value value(const Key &key, const Value &defaultValue = Value()) const
+  {
+    auto it=m_data->forward.constFind(ForwardFirst(&key));
+    return it!=m_data->forward.constEnd()?it.value()->value:defaultValue;
+  }
+  inline QList<Value> values() const { QList<Value> ret; for(auto it=constBeginValue();it!=constEndValue();++it) { ret.append(it.value()); } return ret; }
+  // Two hashes are equal if they hold the same (key, value) pairs, regardless of insertion order
+  inline bool operator==(const HFBiHash<Key, Value> &other) const {
+    if(m_data==other.m_data) // Easy case
+      return true;
+    if(size()!=other.size() || m_data->forward.size()!=other.m_data->forward.size())
+      return false;
+    for(auto it=m_data->forward.constBegin();it!=m_data->forward.constEnd();++it)
+    {
+      auto it2=other.m_data->forward.constFind(it.key());
+      if(it2==other.m_data->forward.constEnd())
+        return false;
+      QVector<const Value *> mine, theirs;
+      for(const Node *node=it.value();node;node=node->next[0])
+        mine.append(&node->value);
+      for(const Node *node=it2.value();node;node=node->next[0])
+        theirs.append(&node->value);
+      if(mine.size()!=theirs.size() || !std::is_permutation(mine.begin(), mine.end(), theirs.begin(), [](const Value *a, const Value *b) { return *a==*b; }))
+        return false;
+    }
+    return true;
+  }
+  inline bool operator!=(const HFBiHash<Key, Value> &other) const { return !(*this==other); }
+protected:
+  QSharedDataPointer<HFBiHashData<Key, Value> > m_data;
+
+  inline const_iterator createForward(typename QHash<ForwardFirst, Node *>::const_iterator iter) const
+  {
+    auto it=const_iterator(m_data.constData(), true);
+    it.m_forwardIt=iter;
+    it.m_node=iter!=m_data->forward.constEnd()?iter.value():nullptr;
+    return it;
+  }
+  inline const_iterator createReverse(typename QHash<ReverseFirst, Node *>::const_iterator iter) const
+  {
+    auto it=const_iterator(m_data.constData(), false);
+    it.m_reverseIt=iter;
+    it.m_node=iter!=m_data->reverse.constEnd()?iter.value():nullptr;
+    return it;
+  }
+  // Iterator on the entry with the given id inside a group, after the hash may have changed (e.g. detached)
+  const_iterator locate(bool isForward, const Key &key, const Value &value, quint64 id)
+  {
+    const_iterator ret=isForward?createForward(m_data->forward.constFind(ForwardFirst(&key))):createReverse(m_data->reverse.constFind(ReverseFirst(&value)));
+    int side=isForward?0:1;
+    while(ret.m_node && ret.m_node->id!=id)
+      ret.m_node=ret.m_node->next[side];
+    return ret;
+  }
+  // Removes the entries of the group starting at first, returning how many they were
+  inline int unlinkGroup(Node *first, int side)
+  {
+    HFBiHashData<Key,Value> *d=m_data.data();
+    int ret=0;
+    for(Node *node=first;node;ret++)
+    {
+      Node *next=node->next[side];
+      d->unlink(node);
+      node=next;
+    }
+    return ret;
+  }
+};
+
+template <class Key, class Value> class HFBiMultiHash: public HFBiHash<Key, Value>
+{
+protected:
+  using HFBiHash<Key, Value>::m_data;
+  using HFBiHash<Key, Value>::createForward;
+  using HFBiHash<Key, Value>::createReverse;
+  typedef typename HFBiHash<Key, Value>::ForwardFirst ForwardFirst;
+  typedef typename HFBiHash<Key, Value>::ReverseFirst ReverseFirst;
+  typedef HFBiHashNode<Key, Value> Node;
+public:
+  inline HFBiMultiHash() {}
+  HFBiMultiHash(const HFBiMultiHash<Key, Value> &other) : HFBiHash<Key, Value>(other) {}
+  HFBiMultiHash(HFBiMultiHash<Key, Value> &&other): HFBiHash<Key, Value>(std::move(other)) {}
+  inline HFBiMultiHash(std::initializer_list<std::pair<Key,Value> > init)
+  {
+    this->reserve(int(init.size()));
+    for (typename std::initializer_list<std::pair<Key,Value> >::const_iterator it = init.begin(); it != init.end(); ++it)
+     insert(it->first, it->second);
+  }
+  HFBiMultiHash<Key, Value> &operator=(HFBiMultiHash<Key, Value> &&other) { HFBiHash<Key, Value>::swap(other); return *this; }
+  HFBiMultiHash<Key, Value> &operator=(const HFBiMultiHash<Key, Value> &other) = default;
+
+  void insert(const Key &key, const Value &value)
+  {
+    HFBiHash<Key, Value>::insertMulti(key, value);
+  }
+  void replace(const Key &key, const Value &value)
+  {
+    HFBiHash<Key, Value>::insert(key, value);
+  }
+  using typename HFBiHash<Key, Value>::iterator;
+  using typename HFBiHash<Key, Value>::const_iterator;
+  using HFBiHash<Key, Value>::find;
+  using HFBiHash<Key, Value>::findConst;
+  using HFBiHash<Key, Value>::findValue;
+  using HFBiHash<Key, Value>::findValueConst;
+  using HFBiHash<Key, Value>::constEnd;
+  using HFBiHash<Key, Value>::contains;
+  using HFBiHash<Key, Value>::count;
+  using HFBiHash<Key, Value>::remove;
+
+  inline bool contains(const Key &key, const Value &value) const
+  {
+    return (findConst(key, value)!=constEnd());
+  }
+  inline int count(const Key &key) const {
+    int ret=0;
+    auto it=m_data->forward.constFind(ForwardFirst(&key));
+    for(const Node *node=it!=m_data->forward.constEnd()?it.value():nullptr;node;node=node->next[0], ++ret) { }
+    return ret;
+  }
+  inline int countValue(const Value &value) const {
+    int ret=0;
+    auto it=m_data->reverse.constFind(ReverseFirst(&value));
+    for(const Node *node=it!=m_data->reverse.constEnd()?it.value():nullptr;node;node=node->next[1], ++ret) { }
+    return ret;
+  }
+  inline iterator find(const Key &key, const Value &value) { return findConst(key, value); }
+  inline const_iterator findConst(const Key &key, const Value &value) const {
+    auto it=findConst(key);
+    while(it.m_node && !(it.m_node->value==value))
+      it.m_node=it.m_node->next[0];
+    return it;
+  }
+  inline iterator findValue(const Value &value, const Key &key) { return findValueConst(value, key); }
+  inline const_iterator findValueConst(const Value &value, const Key &key) const {
+    auto it=findValueConst(value);
+    while(it.m_node && !(it.m_node->key==key))
+      it.m_node=it.m_node->next[1];
+    return it;
+  }
+  inline int remove(const Key &key, const Value &value) {
+    int ret=0;
+    HFBiHashData<Key,Value> *d=m_data.data();
+    for(Node *node=d->forward.value(ForwardFirst(&key), nullptr);node;)
+    {
+      Node *next=node->next[0];
+      if(node->value==value)
+      {
+        d->unlink(node);
+        ret++;
+      }
+      node=next;
+    }
+    return ret;
+  }
+  void swap(HFBiMultiHash<Key, Value> &other) { HFBiHash<Key, Value>::swap(other); }
+  HFBiMultiHash<Key,Value> &operator +=(const HFBiMultiHash<Key,Value> &other)
+  {
+    this->reserve(this->size()+other.size());
+    // Entries of other are added in the order they were added to it, as they are when copying a hash
+    QVector<const Node *> entries;
+    entries.reserve(other.size());
+    for(auto it=other.constBegin();it!=other.constEnd();++it)
+      entries.append(it.m_node);
+    std::sort(entries.begin(), entries.end(), [](const Node *a, const Node *b) { return a->id<b->id; });
+    for(auto it=entries.constBegin();it!=entries.constEnd();++it)
+      insert((*it)->key, (*it)->value);
+    return *this;
+  }
+  HFBiMultiHash<Key,Value> operator +(const HFBiMultiHash<Key,Value> &other) const
+  {
+    HFBiMultiHash<Key,Value> ret(*this);
+    ret+=other;
+    return ret;
+  }
+};
+
+#endif // HFBiHash_Header
@@ -6,13 +6,76 @@
 #ifndef HFBiMap_Header
 #define HFBiMap_Header
 
+#include <QHash>
 #include <QMap>
 #include <QSharedDataPointer>
+#include <QString>
+#include <QVector>
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <class Key, class Value> class HFBiFlatMap;
+
+// Heterogeneous comparisons, so that QString keys and values can be looked up by QStringView or QLatin1String without building a QString.
+// They are templates so that other types (e.g. const char *) are not converted into these ones.
+template <class T> using HFBiMapIfStringProbe = typename std::enable_if<std::is_same<T, QStringView>::value || std::is_same<T, QLatin1String>::value, bool>::type;
+template <class T> inline HFBiMapIfStringProbe<T> qMapLessThanKey(const T &key1, const QString &key2) { return key1<key2; }
+template <class T> inline HFBiMapIfStringProbe<T> qMapLessThanKey(const QString &key1, const T &key2) { return key1<key2; }
+
+// True if qMapLessThanKey compares K with T in both directions, enabling the lookups by K of a map holding T
+template <class K, class T> class HFBiMapIsComparable
+{
+  template <class A, class B> static auto test(int) -> decltype(qMapLessThanKey(std::declval<const A &>(), std::declval<const B &>()) && qMapLessThanKey(std::declval<const B &>(), std::declval<const A &>()), std::true_type());
+  template <class A, class B> static std::false_type test(...);
+public:
+  enum { value=decltype(test<K, T>(0))::value };
+};
+template <class K, class T, class R> using HFBiMapIfComparable = typename std::enable_if<HFBiMapIsComparable<K, T>::value, R>::type;
+
+// Three-way comparison of the keys in the indexes: negative, zero or positive as key1 sorts before, together with or after key2.
+// By default it takes two qMapLessThanKey calls; types with a three-way comparison of their own do a single one.
+template <class T> struct HFBiMapCompare
+{
+  static inline int compare(const T &key1, const T &key2) { return qMapLessThanKey(key1, key2)?-1:(qMapLessThanKey(key2, key1)?1:0); }
+};
+template <> struct HFBiMapCompare<QString>
+{
+  static inline int compare(const QString &key1, const QString &key2) { return key1.compare(key2); }
+};
+
+/** Lookup key of a type K other than T, for the heterogeneous lookups. It sorts right before (lower) or right after (upper) the entries
+ * comparing equal to the key, so QMap can search with it. HFBiMapFirst tells it apart by its id, which no entry ever gets.
+ */
+template <class T> class HFBiMapProbe
+{
+public:
+  template <class K> static inline HFBiMapProbe<T> lower(const K &key) { return HFBiMapProbe<T>(&key, &lowerBefore<K>); }
+  template <class K> static inline HFBiMapProbe<T> upper(const K &key) { return HFBiMapProbe<T>(&key, &upperBefore<K>); }
+  // True if the probe sorts before other
+  inline bool before(const T &other) const { return m_before(m_key, other); }
+private:
+  inline HFBiMapProbe(const void *key, bool (*before)(const void *, const T &)): m_key(key), m_before(before) { }
+  template <class K> static bool lowerBefore(const void *key, const T &other) { return !qMapLessThanKey(other, *static_cast<const K *>(key)); }
+  template <class K> static bool upperBefore(const void *key, const T &other) { return qMapLessThanKey(*static_cast<const K *>(key), other); }
+  const void *m_key;
+  bool (*m_before)(const void *, const T &);
+};
 
 template <class T> struct HFBiMapFirst {
   constexpr HFBiMapFirst(const QPair<const T *, quint64> &init): d(init.first), id(init.second) { }
   constexpr HFBiMapFirst(const T *data, quint64 id): d(data), id(id) { }
+  inline HFBiMapFirst(const HFBiMapProbe<T> &probe): d(reinterpret_cast<const T *>(&probe)), id(std::numeric_limits<quint64>::max()) { }
   constexpr operator const T*() {return d;}
+  inline bool isProbe() const { return id==std::numeric_limits<quint64>::max(); }
+  inline const HFBiMapProbe<T> *probe() const { return reinterpret_cast<const HFBiMapProbe<T> *>(d); }
   const T *d;
   quint64 id;
 };
@@ -23,54 +86,1152 @@ template <class T> struct HFBiMapSecond {
   T *d;
 };
 
-template <class Key, class Value> struct HFBiMapData: public QSharedData
-{
-  HFBiMapData(): id(0) { }
-  HFBiMapData(const HFBiMapData<Key,Value> &base)
+// True if Args is a single T, as when copying or moving a T
+template <class T, class... Args> struct HFBiMapIsObject: std::false_type { };
+template <class T, class Arg> struct HFBiMapIsObject<T, Arg>: std::is_same<T, typename std::decay<Arg>::type> { };
+
+// Compile time list of the indexes of a tuple, to expand its elements into arguments
+template <int... I> struct HFBiMapIndices { };
+template <int N, int... I> struct HFBiMapMakeIndices: HFBiMapMakeIndices<N-1, N-1, I...> { };
+template <int... I> struct HFBiMapMakeIndices<0, I...> { typedef HFBiMapIndices<I...> Type; };
+
+// Arguments of a key built in place by HFBiMap::emplace, passed to the storages instead of a key
+template <class... Args> struct HFBiMapInPlace
+{
+  std::tuple<Args...> args;
+};
+// What the storages build a T from: the argument they are given, or the T built from the arguments of a HFBiMapInPlace
+template <class T> struct HFBiMapConstruct
+{
+  template <class A> static inline A &&argument(A &&a) { return std::forward<A>(a); }
+  template <class... Args> static inline T argument(HFBiMapInPlace<Args...> &&a) { return build(a.args, typename HFBiMapMakeIndices<sizeof...(Args)>::Type()); }
+private:
+  template <class... Args, int... I> static inline T build(std::tuple<Args...> &args, HFBiMapIndices<I...>) { return T(std::forward<Args>(std::get<I>(args))...); }
+};
+
+// Default storage: key and value of every entry are separate heap objects
+template <class Key, class Value> struct HFBiMapHeapStorage
+{
+  template <class K, class... Args> inline QPair<Key *, Value *> create(K &&key, Args&&... args) { return qMakePair(new Key(HFBiMapConstruct<Key>::argument(std::forward<K>(key))), new Value(std::forward<Args>(args)...)); }
+  inline void destroy(const Key *key, const Value *value) { delete key; delete value; }
+  template <class Map> inline void clear(Map &forward)
+  {
+    for(auto it=forward.begin(); it!=forward.end(); it++)
+      destroy(it.key().d, it.value().d);
+  }
+};
+
+// Key and value of an entry allocated as a single block
+template <class Key, class Value> struct HFBiMapEntry
+{
+  template <class K, class... Args> HFBiMapEntry(K &&key, Args&&... args): key(HFBiMapConstruct<Key>::argument(std::forward<K>(key))), value(std::forward<Args>(args)...) { }
+  Key key; // Must stay the first member, see entryOf
+  Value value;
+  static inline HFBiMapEntry<Key, Value> *entryOf(const Key *key) { return reinterpret_cast<HFBiMapEntry<Key, Value> *>(const_cast<Key *>(key)); }
+};
+
+/** Pooled storage: key and value of every entry share a single block carved out of slabs of SlabSize entries.
+ * Freed blocks are recycled through a free list and clear() gives back all the slabs at once.
+ * The id is not duplicated in the block, as both indexes already keep it next to the pointers.
+ */
+template <class Key, class Value, int SlabSize=256> class HFBiMapPoolStorage
+{
+public:
+  HFBiMapPoolStorage(): m_free(nullptr), m_slabUsed(SlabSize) { }
+  // A copy of the map rebuilds its entries inside a pool of its own
+  HFBiMapPoolStorage(const HFBiMapPoolStorage<Key, Value, SlabSize> &): HFBiMapPoolStorage() { }
+  // The slabs hold the entries of the map owning the pool, so they are never handed over to another one
+  HFBiMapPoolStorage<Key, Value, SlabSize> &operator=(const HFBiMapPoolStorage<Key, Value, SlabSize> &) = delete;
+  ~HFBiMapPoolStorage() { releaseSlabs(); }
+  template <class K, class... Args> inline QPair<Key *, Value *> create(K &&key, Args&&... args)
+  {
+    Entry *entry=new (allocate()) Entry(std::forward<K>(key), std::forward<Args>(args)...);
+    return qMakePair(&entry->key, &entry->value);
+  }
+  inline void destroy(const Key *key, const Value *)
+  {
+    Entry *entry=entryOf(key);
+    entry->~Entry();
+    Slot *slot=reinterpret_cast<Slot *>(entry);
+    slot->next=m_free;
+    m_free=slot;
+  }
+  template <class Map> inline void clear(Map &forward)
+  {
+    if(!std::is_trivially_destructible<Entry>::value)
+    {
+      for(auto it=forward.begin(); it!=forward.end(); it++)
+        entryOf(it.key().d)->~Entry();
+    }
+    releaseSlabs();
+  }
+private:
+  typedef HFBiMapEntry<Key, Value> Entry;
+  union Slot
+  {
+    Slot *next;
+    typename std::aligned_storage<sizeof(Entry), alignof(Entry)>::type entry;
+  };
+  static inline Entry *entryOf(const Key *key) { return Entry::entryOf(key); }
+  inline void *allocate()
+  {
+    if(m_free)
+    {
+      Slot *ret=m_free;
+      m_free=ret->next;
+      return ret;
+    }
+    if(m_slabUsed==SlabSize)
+    {
+      m_slabs.append(static_cast<Slot *>(::operator new(sizeof(Slot)*SlabSize)));
+      m_slabUsed=0;
+    }
+    return &m_slabs.last()[m_slabUsed++];
+  }
+  inline void releaseSlabs()
+  {
+    for(auto it=m_slabs.begin(); it!=m_slabs.end(); ++it)
+      ::operator delete(*it);
+    m_slabs.clear();
+    m_free=nullptr;
+    m_slabUsed=SlabSize;
+  }
+  QVector<Slot *> m_slabs;
+  Slot *m_free;
+  int m_slabUsed;
+};
+
+/** Monotonic memory: blocks are carved out of chunks of ChunkSize bytes and are never given back one by one; all the chunks are
+ * freed at once by release() or when the arena is destroyed. Meant for maps living as long as a request or a batch of work, which
+ * then skip the per-entry frees (see HFBiMapArenaAllocator). Not thread safe.
+ */
+class HFBiMapArena
+{
+public:
+  explicit HFBiMapArena(size_t chunkSize=65536): m_chunkSize(chunkSize), m_current(nullptr), m_left(0), m_used(0) { }
+  ~HFBiMapArena() { release(); }
+  void *allocate(size_t size, size_t alignment)
+  {
+    size_t skip=(alignment-reinterpret_cast<quintptr>(m_current)%alignment)%alignment;
+    if(!m_current || skip+size>m_left)
+    {
+      // Blocks larger than a chunk get a chunk of their own, leaving the current one in use
+      if(size+alignment>m_chunkSize)
+        return alignUp(newChunk(size+alignment), alignment, size);
+      m_current=newChunk(m_chunkSize);
+      m_left=m_chunkSize;
+      skip=(alignment-reinterpret_cast<quintptr>(m_current)%alignment)%alignment;
+    }
+    char *ret=m_current+skip;
+    m_current=ret+size;
+    m_left-=skip+size;
+    m_used+=size;
+    return ret;
+  }
+  // Frees all the chunks; everything allocated from the arena must have been destroyed before
+  void release()
+  {
+    for(auto it=m_chunks.begin(); it!=m_chunks.end(); ++it)
+      ::operator delete(*it);
+    m_chunks.clear();
+    m_current=nullptr;
+    m_left=0;
+    m_used=0;
+  }
+  // Bytes handed out since the last release
+  inline size_t used() const { return m_used; }
+private:
+  HFBiMapArena(const HFBiMapArena &) = delete;
+  HFBiMapArena &operator=(const HFBiMapArena &) = delete;
+  inline char *newChunk(size_t size)
+  {
+    m_chunks.append(static_cast<char *>(::operator new(size)));
+    return m_chunks.last();
+  }
+  inline void *alignUp(char *chunk, size_t alignment, size_t size)
+  {
+    m_used+=size;
+    return chunk+(alignment-reinterpret_cast<quintptr>(chunk)%alignment)%alignment;
+  }
+  QVector<char *> m_chunks;
+  size_t m_chunkSize;
+  char *m_current;
+  size_t m_left;
+  size_t m_used;
+};
+
+// Standard allocator drawing from an HFBiMapArena: deallocate does nothing, the memory coming back when the arena is released
+template <class T> class HFBiMapArenaAllocator
+{
+  template <class U> friend class HFBiMapArenaAllocator;
+public:
+  typedef T value_type;
+  inline HFBiMapArenaAllocator(HFBiMapArena &arena): m_arena(&arena) { }
+  template <class U> inline HFBiMapArenaAllocator(const HFBiMapArenaAllocator<U> &other): m_arena(other.m_arena) { }
+  inline T *allocate(size_t n) { return static_cast<T *>(m_arena->allocate(n*sizeof(T), alignof(T))); }
+  inline void deallocate(T *, size_t) { }
+  inline HFBiMapArena *arena() const { return m_arena; }
+  template <class U> inline bool operator==(const HFBiMapArenaAllocator<U> &other) const { return m_arena==other.m_arena; }
+  template <class U> inline bool operator!=(const HFBiMapArenaAllocator<U> &other) const { return m_arena!=other.m_arena; }
+private:
+  HFBiMapArena *m_arena;
+};
+
+/** Storage getting the memory for its entries from Allocator, a standard allocator rebound to the entry type; key and value share a
+ * block as in HFBiMapPoolStorage. A stateful allocator is passed to the map constructor, e.g.
+ *   HFBiMapArena arena;
+ *   HFBiMapArenaAllocator<int> allocator(arena);
+ *   HFBiAllocatorMap<int, QString, HFBiMapArenaAllocator<int> > map(allocator);
+ * Copies of the map made when it detaches use select_on_container_copy_construction of the allocator, so they normally draw from
+ * the same arena. Entries are still destroyed one by one, but with HFBiMapArenaAllocator no memory is freed until the arena is released.
+ * The indexes are QMaps, which allocate their nodes on their own.
+ */
+template <class Key, class Value, class Allocator = std::allocator<Key> > class HFBiMapAllocatorStorage
+{
+  typedef HFBiMapEntry<Key, Value> Entry;
+  typedef typename std::allocator_traits<Allocator>::template rebind_alloc<Entry> EntryAllocator;
+  typedef std::allocator_traits<EntryAllocator> Traits;
+public:
+  HFBiMapAllocatorStorage(const Allocator &allocator = Allocator()): m_allocator(allocator) { }
+  HFBiMapAllocatorStorage(const HFBiMapAllocatorStorage<Key, Value, Allocator> &other): m_allocator(Traits::select_on_container_copy_construction(other.m_allocator)) { }
+  template <class K, class... Args> inline QPair<Key *, Value *> create(K &&key, Args&&... args)
+  {
+    Entry *entry=Traits::allocate(m_allocator, 1);
+    try
+    {
+      Traits::construct(m_allocator, entry, std::forward<K>(key), std::forward<Args>(args)...);
+    }
+    catch(...)
+    {
+      Traits::deallocate(m_allocator, entry, 1);
+      throw;
+    }
+    return qMakePair(&entry->key, &entry->value);
+  }
+  inline void destroy(const Key *key, const Value *)
+  {
+    Entry *entry=Entry::entryOf(key);
+    Traits::destroy(m_allocator, entry);
+    Traits::deallocate(m_allocator, entry, 1);
+  }
+  template <class Map> inline void clear(Map &forward)
+  {
+    for(auto it=forward.begin(); it!=forward.end(); it++)
+      destroy(it.key().d, it.value().d);
+  }
+  inline Allocator allocator() const { return Allocator(m_allocator); }
+private:
+  EntryAllocator m_allocator;
+};
+
+// Reference counted set of distinct objects, see HFBiMapInternStorage
+template <class T> class HFBiMapInternPool
+{
+public:
+  // Shared copy of object
+  inline T *acquire(const T &object)
+  {
+    auto it=m_refs.find(object);
+    if(it==m_refs.end())
+      it=m_refs.insert(object, 0);
+    ++it.value();
+    return const_cast<T *>(&it.key());
+  }
+  // Builds the object from args first; skipped when args is already a T
+  template <class... Args> inline typename std::enable_if<!HFBiMapIsObject<T, Args...>::value, T *>::type acquire(Args&&... args) { return acquire(T(std::forward<Args>(args)...)); }
+  inline void release(const T *object)
+  {
+    auto it=m_refs.find(*object);
+    if(--it.value()==0)
+      m_refs.erase(it);
+  }
+  inline int count(const T &object) const { return m_refs.value(object, 0); }
+  inline void clear() { m_refs.clear(); }
+private:
+  // QMap nodes never move, so the pointers to their keys stay valid
+  QMap<T, int> m_refs;
+};
+
+/** Interning storage: equal keys and equal values are stored only once and shared among all the entries holding them,
+ * each copy being freed when its last entry is removed. Meant for multi maps where many entries hold the same key or value;
+ * HFBiMultiMap::count/countValue then take the number of entries from the reference count instead of walking them.
+ */
+template <class Key, class Value> class HFBiMapInternStorage
+{
+public:
+  HFBiMapInternStorage() { }
+  // A copy of the map rebuilds its entries, sharing among them only
+  HFBiMapInternStorage(const HFBiMapInternStorage<Key, Value> &) { }
+  template <class K, class... Args> inline QPair<Key *, Value *> create(K &&key, Args&&... args)
+  {
+    return qMakePair(m_keys.acquire(HFBiMapConstruct<Key>::argument(std::forward<K>(key))), m_values.acquire(std::forward<Args>(args)...));
+  }
+  inline void destroy(const Key *key, const Value *value) { m_keys.release(key); m_values.release(value); }
+  template <class Map> inline void clear(Map &) { m_keys.clear(); m_values.clear(); }
+  // Number of entries holding key or value
+  inline int countKey(const Key &key) const { return m_keys.count(key); }
+  inline int countValue(const Value &value) const { return m_values.count(value); }
+private:
+  HFBiMapInternPool<Key> m_keys;
+  HFBiMapInternPool<Value> m_values;
+};
+// True for the storages which know how many entries hold a key or a value
+template <class Storage> struct HFBiMapStorageCounts: std::false_type { };
+template <class Key, class Value> struct HFBiMapStorageCounts<HFBiMapInternStorage<Key, Value> >: std::true_type { };
+// True for the storages whose entries share their keys or values, which then can't be moved out of an entry
+template <class Storage> struct HFBiMapStorageShares: std::false_type { };
+template <class Key, class Value> struct HFBiMapStorageShares<HFBiMapInternStorage<Key, Value> >: std::true_type { };
+
+// Events counted by HFBiMapStatsStorage
+struct HFBiMapStats
+{
+  quint64 comparisons; // Done by the indexes while searching and inserting
+  quint64 allocations; // Entries created by the storage
+  quint64 frees;       // Entries destroyed by the storage
+  quint64 detaches;    // Deep copies of the map data, made when a shared map is modified
+  quint64 scans;       // Walks over a run of entries sharing a key or value (remove, count...)
+  quint64 scanned;     // Entries visited by those walks
+  quint64 hits;        // Lookups by find or findValue which found an entry, counted by HFBiMapCacheStorage
+  quint64 misses;      // Those which didn't
+  quint64 evictions;   // Entries removed by HFBiMapCacheStorage to make room for new ones
+};
+
+// Index key of maps keeping statistics: entries point to the counters of their map, so that comparisons can be counted
+template <class T> struct HFBiMapCountedFirst: public HFBiMapFirst<T>
+{
+  using HFBiMapFirst<T>::HFBiMapFirst;
+  inline HFBiMapCountedFirst(const T *data, quint64 id, HFBiMapStats *stats): HFBiMapFirst<T>(data, id), stats(stats) { }
+  // Null for lookup keys, which are always compared with an entry
+  HFBiMapStats *stats=nullptr;
+};
+
+/** Storage counting the events listed in HFBiMapStats, while Storage does the actual allocations. Counters are kept along with the
+ * map data: copies of a map share them until one of them is modified, which then goes on from the counts of the original.
+ * Counters are not atomic, so a map keeping statistics must not be read by several threads at once.
+ */
+template <class Storage> class HFBiMapStatsStorage: public Storage
+{
+public:
+  HFBiMapStatsStorage(): m_stats() { }
+  explicit HFBiMapStatsStorage(const Storage &storage): Storage(storage), m_stats() { }
+  HFBiMapStatsStorage(const HFBiMapStatsStorage<Storage> &other): Storage(other), m_stats(other.m_stats) { }
+  template <class K, class... Args> inline auto create(K &&key, Args&&... args) -> decltype(std::declval<Storage &>().create(std::forward<K>(key), std::forward<Args>(args)...))
+  {
+    m_stats.allocations++;
+    return Storage::create(std::forward<K>(key), std::forward<Args>(args)...);
+  }
+  template <class K, class V> inline void destroy(const K *key, const V *value)
+  {
+    m_stats.frees++;
+    Storage::destroy(key, value);
+  }
+  template <class Map> inline void clear(Map &forward)
+  {
+    m_stats.frees+=quint64(forward.size());
+    Storage::clear(forward);
+  }
+  inline const HFBiMapStats &stats() const { return m_stats; }
+  inline void resetStats() { m_stats=HFBiMapStats(); }
+  // Mutable, as entries are also scanned and compared by const functions
+  mutable HFBiMapStats m_stats;
+};
+
+template <class Storage> struct HFBiMapStorageCounts<HFBiMapStatsStorage<Storage> >: HFBiMapStorageCounts<Storage> { };
+template <class Storage> struct HFBiMapStorageShares<HFBiMapStatsStorage<Storage> >: HFBiMapStorageShares<Storage> { };
+
+// Integer made of the first bytes of a key, such that prefix(a)<prefix(b) implies a<b; keys with equal prefixes must be compared in full.
+// Only the types specializing it get a prefix, see HFBiMapPrefixStorage.
+template <class T> struct HFBiMapKeyPrefix
+{
+  enum { enabled=false };
+};
+template <> struct HFBiMapKeyPrefix<QString>
+{
+  enum { enabled=true };
+  // First four UTF-16 units, padded with zeros: QString sorts by the numeric value of its units
+  static inline quint64 of(const QString &key)
+  {
+    auto units=key.utf16();
+    int n=qMin(key.size(), 4);
+    quint64 ret=0;
+    for(int i=0;i<n;i++)
+      ret|=quint64(quint16(units[i]))<<(48-16*i);
+    return ret;
+  }
+};
+
+// Index key of maps caching the key prefixes, computed once when the index key is built (probes have none)
+template <class T> struct HFBiMapPrefixedFirst: public HFBiMapFirst<T>
+{
+  inline HFBiMapPrefixedFirst(const T *data, quint64 id): HFBiMapFirst<T>(data, id), prefix(HFBiMapKeyPrefix<T>::of(*data)) { }
+  inline HFBiMapPrefixedFirst(const QPair<const T *, quint64> &init): HFBiMapPrefixedFirst(init.first, init.second) { }
+  inline HFBiMapPrefixedFirst(const HFBiMapProbe<T> &probe): HFBiMapFirst<T>(probe), prefix(0) { }
+  quint64 prefix;
+};
+
+/** Storage making the indexes keep the prefix of every key and value next to the pointer to it (see HFBiMapKeyPrefix), so that most
+ * of the comparisons done while searching are decided by comparing two integers, and the keys themselves are only read when the
+ * prefixes are equal. Worth it for long strings not sharing their first characters; it takes 8 more bytes per entry in each index
+ * having a prefix. Storage does the actual allocations. Comparisons of prefixed keys are not counted by HFBiMapStatsStorage.
+ */
+template <class Storage> class HFBiMapPrefixStorage: public Storage
+{
+public:
+  HFBiMapPrefixStorage() { }
+  explicit HFBiMapPrefixStorage(const Storage &storage): Storage(storage) { }
+};
+
+template <class Storage> struct HFBiMapStorageCounts<HFBiMapPrefixStorage<Storage> >: HFBiMapStorageCounts<Storage> { };
+template <class Storage> struct HFBiMapStorageShares<HFBiMapPrefixStorage<Storage> >: HFBiMapStorageShares<Storage> { };
+
+// A change recorded by HFBiMapJournalStorage. id is the one of the entry inserted or removed; key and value are left default
+// constructed for Cleared, which removes all the entries at once.
+template <class Key, class Value> struct HFBiMapChange
+{
+  enum Type { Inserted, Removed, Cleared };
+  Type type;
+  quint64 id;
+  Key key;
+  Value value;
+};
+// Changes turning a map as it was at version from into the one at version to, see HFBiMap::changesSince
+template <class Key, class Value> struct HFBiMapDelta
+{
+  quint64 from;
+  quint64 to;
+  QVector<HFBiMapChange<Key, Value> > changes;
+};
+
+/** Storage keeping a journal of the changes made to the map, with a copy of the key and value of every entry inserted or removed,
+ * so that a replica of the map can be kept equal by shipping it only the changes (see HFBiMap::changesSince and applyDelta) instead
+ * of comparing or copying the whole map. The version of the map counts the changes recorded since it was created. Operations
+ * rebuilding the indexes (assign, unite, merge...) are recorded as a Cleared change followed by the insertion of every entry.
+ * The journal grows with every change: it can be trimmed once all the consumers have synced, or given a limit, in which case it keeps
+ * between limit and twice as many of the latest changes. Storage does the actual allocations.
+ */
+template <class Key, class Value, class Storage = HFBiMapHeapStorage<Key, Value> > class HFBiMapJournalStorage: public Storage
+{
+public:
+  HFBiMapJournalStorage(): m_start(0), m_limit(0) { }
+  explicit HFBiMapJournalStorage(int limit): m_start(0), m_limit(limit) { }
+  explicit HFBiMapJournalStorage(const Storage &storage, int limit=0): Storage(storage), m_start(0), m_limit(limit) { }
+  inline quint64 version() const { return m_start+quint64(m_changes.size()); }
+  // Oldest version the journal can tell the changes from
+  inline quint64 start() const { return m_start; }
+  void record(typename HFBiMapChange<Key, Value>::Type type, const Key *key, const Value *value, quint64 id)
+  {
+    m_changes.append({type, id, key?*key:Key(), value?*value:Value()});
+    if(m_limit>0 && m_changes.size()>=2*m_limit)
+      trim(version()-quint64(m_limit));
+  }
+  // Appends to changes those made after version, returning false if the journal doesn't hold them
+  bool changesSince(quint64 version, QVector<HFBiMapChange<Key, Value> > &changes) const
+  {
+    if(version<m_start || version>this->version())
+      return false;
+    for(int i=int(version-m_start);i<m_changes.size();i++)
+      changes.append(m_changes.at(i));
+    return true;
+  }
+  // Forgets the changes up to version
+  void trim(quint64 version)
+  {
+    if(version<=m_start)
+      return;
+    int n=int(qMin(version, this->version())-m_start);
+    m_changes.erase(m_changes.begin(), m_changes.begin()+n);
+    m_start+=quint64(n);
+  }
+private:
+  QVector<HFBiMapChange<Key, Value> > m_changes;
+  quint64 m_start;
+  int m_limit;
+};
+
+template <class Key, class Value, class Storage> struct HFBiMapStorageCounts<HFBiMapJournalStorage<Key, Value, Storage> >: HFBiMapStorageCounts<Storage> { };
+template <class Key, class Value, class Storage> struct HFBiMapStorageShares<HFBiMapJournalStorage<Key, Value, Storage> >: HFBiMapStorageShares<Storage> { };
+
+/** Storage turning the map into a cache holding at most capacity entries: before an entry is added, the entries found least recently
+ * (LRU) or least often (LFU, ties going to the least recent one) by find/findValue are removed from both indexes until it fits.
+ * If a cost function is given, capacity is a budget (e.g. in bytes) shared among the entries according to it instead; an entry costing
+ * more than the whole budget is still added, once all the others are evicted, and the total exceeds capacity until it is evicted in
+ * turn. The hits, misses and evictions are counted in HFBiMap::stats (to also count the other events, wrap a HFBiMapStatsStorage in
+ * this one).
+ * The bookkeeping takes constant time per lookup and per change, in a hash from the entry ids, which survive a copy of the map.
+ * Lookups modify it, so they count as changes: even the const ones detach a map sharing its data with a copy (which keeps its own
+ * recency and counters), a cache must not be declared const, and it is not safe to read it from several threads at once, not even
+ * through const functions. Storage does the actual allocations.
+ */
+template <class Key, class Value, class Storage = HFBiMapHeapStorage<Key, Value> > class HFBiMapCacheStorage: public Storage
+{
+public:
+  enum Policy { LRU, LFU };
+  typedef qint64 (*Cost)(const Key &key, const Value &value);
+  explicit HFBiMapCacheStorage(qint64 capacity=std::numeric_limits<qint64>::max(), Policy policy=LRU, Cost cost=nullptr, const Storage &storage=Storage()):
+    Storage(storage), m_head(0), m_tail(0), m_capacity(capacity), m_total(0), m_policy(policy), m_cost(cost), m_hits(0), m_misses(0), m_evictions(0) { }
+  inline qint64 capacity() const { return m_capacity; }
+  // Sum of the costs of the entries
+  inline qint64 total() const { return m_total; }
+  inline Policy policy() const { return m_policy; }
+  void linked(const Key *key, const Value *value, quint64 id)
+  {
+    qint64 cost=m_cost?m_cost(*key, *value):1;
+    m_nodes.insert(id, {key, value, 0, 0, 1, cost});
+    m_total+=cost;
+    // A new entry has been used once, so under LFU it goes before those used more
+    if(m_policy==LRU)
+      place(id, m_tail);
+    else
+    {
+      place(id, m_last.value(1, 0));
+      m_last.insert(1, id);
+    }
+  }
+  void unlinked(quint64 id)
+  {
+    if(!m_nodes.contains(id))
+      return;
+    forget(id);
+    cut(id);
+    m_total-=m_nodes.value(id).cost;
+    m_nodes.remove(id);
+  }
+  void cleared()
+  {
+    m_nodes.clear();
+    m_last.clear();
+    m_head=m_tail=0;
+    m_total=0;
+  }
+  // The entry with id was copied to key and value
+  inline void copied(const Key *key, const Value *value, quint64 id)
+  {
+    auto it=m_nodes.find(id);
+    if(it!=m_nodes.end())
+    {
+      it.value().key=key;
+      it.value().value=value;
+    }
+  }
+  // Records a lookup, which found the entry with id unless it is 0
+  void touch(quint64 id) const
+  {
+    auto it=m_nodes.find(id);
+    if(it==m_nodes.end())
+    {
+      m_misses++;
+      return;
+    }
+    m_hits++;
+    if(m_policy==LRU)
+    {
+      if(id!=m_tail)
+      {
+        cut(id);
+        place(id, m_tail);
+      }
+      return;
+    }
+    // The entry moves after the last one used as many times as it is now, or after the last one used as many times as it was
+    quint64 uses=it.value().uses;
+    quint64 after=m_last.value(uses+1, 0);
+    forget(id);
+    if(!after)
+      after=m_last.value(uses, 0);
+    if(after)
+    {
+      cut(id);
+      place(id, after);
+    }
+    m_nodes[id].uses=uses+1;
+    m_last.insert(uses+1, id);
+  }
+  // Next entry to be evicted before one with key and value (none if key is null) is added, returning false if there is no need to
+  bool victim(const Key *key, const Value *value, const Key *&victimKey, const Value *&victimValue, quint64 &victimId)
+  {
+    qint64 cost=key?(m_cost?m_cost(*key, *value):1):0;
+    if(!m_head || m_total+cost<=m_capacity)
+      return false;
+    const Node &node=m_nodes[m_head];
+    victimKey=node.key;
+    victimValue=node.value;
+    victimId=m_head;
+    return true;
+  }
+  // The victim has been removed
+  inline void evicted() { m_evictions++; }
+  inline quint64 hits() const { return m_hits; }
+  inline quint64 misses() const { return m_misses; }
+  inline quint64 evictions() const { return m_evictions; }
+  inline void resetCounters() { m_hits=m_misses=m_evictions=0; }
+private:
+  // Entries are kept in a list from the next one to be evicted (head) to the last one (tail), linked by their ids (0 for none)
+  struct Node
+  {
+    const Key *key;
+    const Value *value;
+    quint64 previous, next;
+    quint64 uses;
+    qint64 cost;
+  };
+  // Inserts the entry after the one with id after, or at the head if it is 0
+  void place(quint64 id, quint64 after) const
+  {
+    Node &node=m_nodes[id];
+    node.previous=after;
+    node.next=after?m_nodes[after].next:m_head;
+    (node.next?m_nodes[node.next].previous:m_tail)=id;
+    (after?m_nodes[after].next:m_head)=id;
+  }
+  void cut(quint64 id) const
+  {
+    Node &node=m_nodes[id];
+    (node.previous?m_nodes[node.previous].next:m_head)=node.next;
+    (node.next?m_nodes[node.next].previous:m_tail)=node.previous;
+  }
+  // Under LFU, the entry is no longer among those with its number of uses
+  void forget(quint64 id) const
+  {
+    if(m_policy!=LFU)
+      return;
+    const Node &node=m_nodes[id];
+    if(m_last.value(node.uses, 0)!=id)
+      return;
+    if(node.previous && m_nodes[node.previous].uses==node.uses)
+      m_last.insert(node.uses, node.previous);
+    else
+      m_last.remove(node.uses);
+  }
+  mutable QHash<quint64, Node> m_nodes;
+  // Under LFU, the list is sorted by number of uses: this is the last entry for each of them
+  mutable QHash<quint64, quint64> m_last;
+  mutable quint64 m_head, m_tail;
+  qint64 m_capacity, m_total;
+  Policy m_policy;
+  Cost m_cost;
+  mutable quint64 m_hits, m_misses;
+  quint64 m_evictions;
+};
+
+template <class Key, class Value, class Storage> struct HFBiMapStorageCounts<HFBiMapCacheStorage<Key, Value, Storage> >: HFBiMapStorageCounts<Storage> { };
+template <class Key, class Value, class Storage> struct HFBiMapStorageShares<HFBiMapCacheStorage<Key, Value, Storage> >: HFBiMapStorageShares<Storage> { };
+
+// Hooks used by HFBiMap to count its events, to build the index keys, to record its changes and to evict entries: they do nothing, and
+// the indexes use plain HFBiMapFirst, unless statistics, prefixes, a journal or a cache are enabled
+template <class Storage> struct HFBiMapStatistics
+{
+  enum { Records=false };
+  // False if the index keys can't be compared by several threads at once
+  enum { Concurrent=true };
+  // True if lookups change the storage, so that they must detach the map first
+  enum { Touches=false };
+  template <class T> using First = HFBiMapFirst<T>;
+  template <class T> static inline HFBiMapFirst<T> first(const Storage &, const T *data, quint64 id) { return HFBiMapFirst<T>(data, id); }
+  static inline void scanned(const Storage &, int) { }
+  static inline void detached(Storage &) { }
+  static inline HFBiMapStats stats(const Storage &) { return HFBiMapStats(); }
+  static inline void reset(Storage &) { }
+  template <class K, class V> static inline void linked(Storage &, const K *, const V *, quint64) { }
+  template <class K, class V> static inline void unlinked(Storage &, const K *, const V *, quint64) { }
+  static inline void cleared(Storage &) { }
+  template <class K, class V> static inline void copied(Storage &, const K *, const V *, quint64) { }
+  static inline void accessed(const Storage &, quint64) { }
+  template <class K, class V> static inline bool evicting(Storage &, const K *, const V *, const K *&, const V *&, quint64 &) { return false; }
+  static inline void evicted(Storage &) { }
+};
+template <class Storage> struct HFBiMapStatistics<HFBiMapStatsStorage<Storage> >: public HFBiMapStatistics<Storage>
+{
+  // Comparisons are counted without atomics
+  enum { Concurrent=false };
+  template <class T> using First = HFBiMapCountedFirst<T>;
+  template <class T> static inline HFBiMapCountedFirst<T> first(const HFBiMapStatsStorage<Storage> &storage, const T *data, quint64 id) { return HFBiMapCountedFirst<T>(data, id, &storage.m_stats); }
+  static inline void scanned(const HFBiMapStatsStorage<Storage> &storage, int count) { storage.m_stats.scans++; storage.m_stats.scanned+=quint64(count); }
+  static inline void detached(HFBiMapStatsStorage<Storage> &storage) { storage.m_stats.detaches++; }
+  static inline HFBiMapStats stats(const HFBiMapStatsStorage<Storage> &storage) { return storage.stats(); }
+  static inline void reset(HFBiMapStatsStorage<Storage> &storage) { storage.resetStats(); }
+};
+template <class Storage> struct HFBiMapStatistics<HFBiMapPrefixStorage<Storage> >: public HFBiMapStatistics<Storage>
+{
+  template <class T> using First = typename std::conditional<HFBiMapKeyPrefix<T>::enabled, HFBiMapPrefixedFirst<T>, typename HFBiMapStatistics<Storage>::template First<T> >::type;
+  template <class T> static inline First<T> first(const HFBiMapPrefixStorage<Storage> &storage, const T *data, quint64 id) { return first(storage, data, id, std::integral_constant<bool, HFBiMapKeyPrefix<T>::enabled>()); }
+private:
+  template <class T> static inline First<T> first(const HFBiMapPrefixStorage<Storage> &, const T *data, quint64 id, std::true_type) { return First<T>(data, id); }
+  template <class T> static inline First<T> first(const HFBiMapPrefixStorage<Storage> &storage, const T *data, quint64 id, std::false_type) { return HFBiMapStatistics<Storage>::first(storage, data, id); }
+};
+template <class Key, class Value, class Storage> struct HFBiMapStatistics<HFBiMapJournalStorage<Key, Value, Storage> >: public HFBiMapStatistics<Storage>
+{
+  typedef HFBiMapStatistics<Storage> Base;
+  enum { Records=true };
+  static inline void linked(HFBiMapJournalStorage<Key, Value, Storage> &storage, const Key *key, const Value *value, quint64 id) { storage.record(HFBiMapChange<Key, Value>::Inserted, key, value, id); Base::linked(storage, key, value, id); }
+  static inline void unlinked(HFBiMapJournalStorage<Key, Value, Storage> &storage, const Key *key, const Value *value, quint64 id) { storage.record(HFBiMapChange<Key, Value>::Removed, key, value, id); Base::unlinked(storage, key, value, id); }
+  static inline void cleared(HFBiMapJournalStorage<Key, Value, Storage> &storage) { storage.record(HFBiMapChange<Key, Value>::Cleared, nullptr, nullptr, 0); Base::cleared(storage); }
+};
+template <class Key, class Value, class Storage> struct HFBiMapStatistics<HFBiMapCacheStorage<Key, Value, Storage> >: public HFBiMapStatistics<Storage>
+{
+  typedef HFBiMapStatistics<Storage> Base;
+  enum { Records=true };
+  enum { Touches=true };
+  static inline void linked(HFBiMapCacheStorage<Key, Value, Storage> &storage, const Key *key, const Value *value, quint64 id) { storage.linked(key, value, id); Base::linked(storage, key, value, id); }
+  static inline void unlinked(HFBiMapCacheStorage<Key, Value, Storage> &storage, const Key *key, const Value *value, quint64 id) { storage.unlinked(id); Base::unlinked(storage, key, value, id); }
+  static inline void cleared(HFBiMapCacheStorage<Key, Value, Storage> &storage) { storage.cleared(); Base::cleared(storage); }
+  static inline void copied(HFBiMapCacheStorage<Key, Value, Storage> &storage, const Key *key, const Value *value, quint64 id) { storage.copied(key, value, id); }
+  static inline void accessed(const HFBiMapCacheStorage<Key, Value, Storage> &storage, quint64 id) { storage.touch(id); }
+  static inline bool evicting(HFBiMapCacheStorage<Key, Value, Storage> &storage, const Key *key, const Value *value, const Key *&victimKey, const Value *&victimValue, quint64 &victimId)
+  {
+    return storage.victim(key, value, victimKey, victimValue, victimId);
+  }
+  static inline void evicted(HFBiMapCacheStorage<Key, Value, Storage> &storage) { storage.evicted(); }
+  static inline HFBiMapStats stats(const HFBiMapCacheStorage<Key, Value, Storage> &storage)
+  {
+    HFBiMapStats ret=Base::stats(storage);
+    ret.hits=storage.hits();
+    ret.misses=storage.misses();
+    ret.evictions=storage.evictions();
+    return ret;
+  }
+  static inline void reset(HFBiMapCacheStorage<Key, Value, Storage> &storage) { storage.resetCounters(); Base::reset(storage); }
+};
+
+// Helpers running the bulk operations of HFBiMap on several threads
+struct HFBiMapParallel
+{
+  // Slices smaller than this are not worth a thread of their own
+  enum { MinimumSlice=1<<14 };
+  static inline int threads() { return qMax(1, int(std::thread::hardware_concurrency())); }
+  // Calls f(i) for i from 0 to count-1, each call on a thread of its own (the last one on the calling thread)
+  template <class Function> static void each(int count, const Function &f)
+  {
+    std::vector<std::thread> workers;
+    workers.reserve(count>0?count-1:0);
+    for(int i=0;i<count-1;i++)
+      workers.emplace_back(f, i);
+    if(count>0)
+      f(count-1);
+    for(auto it=workers.begin();it!=workers.end();++it)
+      it->join();
+  }
+  // Sorts [first, last) on up to threads threads: every thread sorts a slice, then the slices are merged in pairs, each round of merges
+  // halving their number and running on as many threads as merges
+  template <class Iterator, class Less> static void sort(Iterator first, Iterator last, const Less &less, int threads)
+  {
+    qptrdiff n=last-first;
+    int slices=int(qMin<qptrdiff>(threads, n/MinimumSlice));
+    if(slices<2)
+    {
+      std::sort(first, last, less);
+      return;
+    }
+    QVector<Iterator> bounds;
+    for(int i=0;i<=slices;i++)
+      bounds.append(first+n*i/slices);
+    each(slices, [&bounds, &less](int i) { std::sort(bounds.at(i), bounds.at(i+1), less); });
+    for(int width=1;width<slices;width*=2)
+    {
+      int merges=(slices+2*width-1)/(2*width);
+      each(merges, [&bounds, &less, width, slices](int i) {
+        int low=2*width*i;
+        if(low+width<slices)
+          std::inplace_merge(bounds.at(low), bounds.at(low+width), bounds.at(qMin(low+2*width, slices)), less);
+      });
+    }
+  }
+};
+
+template <class Key, class Value, class Storage = HFBiMapHeapStorage<Key, Value> > struct HFBiMapData: public QSharedData
+{
+  typedef HFBiMapStatistics<Storage> Statistics;
+  typedef typename Statistics::template First<Key> ForwardFirst;
+  typedef typename Statistics::template First<Value> ReverseFirst;
+  HFBiMapData(): id(0), runs(false) { }
+  explicit HFBiMapData(const Storage &storage): id(0), storage(storage), runs(false) { }
+  // The storage is copied, not shared: a storage copy starts empty
+  HFBiMapData(const HFBiMapData<Key,Value,Storage> &base): storage(base.storage), keyRuns(base.keyRuns), valueRuns(base.valueRuns), runs(base.runs)
+  {
+    id=base.id;
+    Statistics::detached(storage);
+    for(auto it=base.forward.begin();it!=base.forward.end();++it)
+    {
+      auto copy=storage.create(*it.key().d, *it.value().d);
+      forward.insertMulti(forwardFirst(copy.first, it.key().id), copy.second);
+      reverse.insertMulti(reverseFirst(copy.second, it.key().id), copy.first);
+      Statistics::copied(storage, copy.first, copy.second, it.key().id);
+    }
+  }
+  ~HFBiMapData() { clear(); }
+  QMap<ForwardFirst, HFBiMapSecond<Value> > forward;
+  QMap<ReverseFirst, HFBiMapSecond<Key> > reverse;
+  quint64 id;
+  Storage storage;
+  // Number of entries holding each key and each value, kept if runs is set (see countRuns)
+  QMap<Key, int> keyRuns;
+  QMap<Value, int> valueRuns;
+  bool runs;
+  // Empty data keeping the storage settings (e.g. the allocator), not its entries, and counting the runs if this one does
+  inline HFBiMapData<Key,Value,Storage> *blank() const
+  {
+    auto ret=new HFBiMapData<Key,Value,Storage>(storage);
+    ret->runs=runs;
+    return ret;
+  }
+  // Starts counting the entries holding each key and value, as HFBiMultiMap does so that count and countValue don't walk them
+  void countRuns()
+  {
+    if(runs)
+      return;
+    runs=true;
+    for(auto it=forward.constBegin();it!=forward.constEnd();++it)
+      run(it.key().d, it.value().d);
+  }
+  // Index keys of a new entry
+  inline ForwardFirst forwardFirst(const Key *key, quint64 id) const { return Statistics::first(storage, key, id); }
+  inline ReverseFirst reverseFirst(const Value *value, quint64 id) const { return Statistics::first(storage, value, id); }
+  // Changes to the entries, recorded if the storage keeps a journal (see HFBiMapJournalStorage) and counted in the runs
+  inline void linked(const Key *key, const Value *value, quint64 id)
+  {
+    Statistics::linked(storage, key, value, id);
+    if(runs)
+      run(key, value);
+  }
+  inline void unlinked(const Key *key, const Value *value, quint64 id)
+  {
+    Statistics::unlinked(storage, key, value, id);
+    if(runs)
+    {
+      release(keyRuns, *key);
+      release(valueRuns, *value);
+    }
+  }
+  inline void cleared()
+  {
+    Statistics::cleared(storage);
+    keyRuns.clear();
+    valueRuns.clear();
+  }
+  // Records the indexes as filled from scratch: all the entries were removed, then the current ones inserted. Entries which no longer
+  // fit in a cache are then evicted.
+  void relinked()
+  {
+    if(!Statistics::Records && !runs)
+      return;
+    cleared();
+    for(auto it=forward.constBegin();it!=forward.constEnd();++it)
+      linked(it.key().d, it.value().d, it.key().id);
+    evict(nullptr, nullptr);
+  }
+  // If the storage is a cache, removes the entries it chooses until one with key and value (none if key is null) fits in it
+  void evict(const Key *key, const Value *value)
+  {
+    Entry victim;
+    while(Statistics::evicting(storage, key, value, victim.key, victim.value, victim.id))
+    {
+      unlink(victim);
+      Statistics::evicted(storage);
+    }
+  }
+  void clear(){
+    storage.clear(forward);
+    forward.clear();
+    reverse.clear();
+  }
+  // An entry, as seen by the indexes
+  struct Entry
+  {
+    const Key *key;
+    const Value *value;
+    quint64 id;
+  };
+  // Entry at a position of the forward (reverse) index
+  static inline Entry forwardEntry(const typename QMap<ForwardFirst, HFBiMapSecond<Value> >::iterator &it) { return {it.key().d, it.value().d, it.key().id}; }
+  static inline Entry reverseEntry(const typename QMap<ReverseFirst, HFBiMapSecond<Key> >::iterator &it) { return {it.value().d, it.key().d, it.key().id}; }
+  // Removes a single entry without allocating a batch. The last one is freed by clearing the indexes, but recorded as removed.
+  int unlink(const Entry &entry)
+  {
+    if(forward.size()==1)
+    {
+      unlinked(entry.key, entry.value, entry.id);
+      clear();
+    }
+    else
+      drop(entry);
+    return 1;
+  }
+  // Removes a batch of entries from both indexes and frees them, returning how many they were. Small batches are erased one at a time,
+  // each erase searching both indexes; larger ones rebuild both indexes from the surviving entries, walking each of them once.
+  int unlink(const QVector<Entry> &doomed)
+  {
+    int n=doomed.size();
+    if(!n)
+      return 0;
+    if(n==forward.size())
+    {
+      cleared();
+      clear();
+    }
+    else if(qint64(n)*RebuildRatio<=forward.size())
+    {
+      for(auto it=doomed.constBegin();it!=doomed.constEnd();++it)
+        drop(*it);
+    }
+    else
+    {
+      QVector<quint64> ids;
+      ids.reserve(n);
+      for(auto it=doomed.constBegin();it!=doomed.constEnd();++it)
+        ids.append(it->id);
+      std::sort(ids.begin(), ids.end());
+      keep(forward, ids);
+      keep(reverse, ids);
+      for(auto it=doomed.constBegin();it!=doomed.constEnd();++it)
+      {
+        unlinked(it->key, it->value, it->id);
+        storage.destroy(it->key, it->value);
+      }
+    }
+    return n;
+  }
+  // One more (one less) entry holding key and value
+  inline void run(const Key *key, const Value *value)
+  {
+    ++keyRuns[*key];
+    ++valueRuns[*value];
+  }
+  template <class T> static inline void release(QMap<T, int> &counts, const T &t)
+  {
+    auto it=counts.find(t);
+    if(--it.value()==0)
+      counts.erase(it);
+  }
+  // Removes entry from both indexes and frees it
+  inline void drop(const Entry &entry)
+  {
+    forward.remove(forwardFirst(entry.key, entry.id));
+    reverse.remove(reverseFirst(entry.value, entry.id));
+    unlinked(entry.key, entry.value, entry.id);
+    storage.destroy(entry.key, entry.value);
+  }
+  // Replaces index with a copy holding only the entries whose id is not in the sorted ids, inserted as in build
+  template <class Index> static void keep(Index &index, const QVector<quint64> &ids)
+  {
+    Index kept;
+    for(auto it=index.constEnd();it!=index.constBegin();)
+    {
+      --it;
+      if(!std::binary_search(ids.constBegin(), ids.constEnd(), it.key().id))
+        kept.insertMulti(kept.constBegin(), it.key(), it.value());
+    }
+    index.swap(kept);
+  }
+  // Batches removing more than one entry out of RebuildRatio rebuild the indexes, smaller ones erase entries one at a time
+  enum { RebuildRatio=8 };
+  // Builds of at least as many entries use two threads or more
+  enum { ParallelMinimum=1<<16 };
+
+  // Fills the empty indexes with the entries of a followed by those of b, as if the latter had been added after all the former
+  // (the entries of a keep their ids). If unique is set, entries are dropped as insert would have done: those of a sharing their key
+  // or value with an entry of b, and those of b sharing it with a later entry of b. Entries are moved out of a (b) if moveA (moveB)
+  // is set, which leaves a (b) only fit to be destroyed, and copied otherwise.
+  // Each index of a and b is walked once, and the result is merged from them as they are already sorted: no search is done.
+  void unite(const HFBiMapData<Key,Value,Storage> &a, bool moveA, const HFBiMapData<Key,Value,Storage> &b, bool moveB, bool unique)
   {
-    id=base.id;
-    for(auto it=base.forward.begin();it!=base.forward.end();++it)
+    QVector<quint64> dropA, dropB;
+    if(unique)
     {
-      auto keyCopy=new Key(*it.key().d);
-      auto dataCopy=new Value(*it.value());
-      forward.insertMulti({keyCopy, it.key().id}, dataCopy);
-      reverse.insertMulti({dataCopy, it.key().id}, keyCopy);
+      shared(a.forward, b.forward, dropA);
+      shared(a.reverse, b.reverse, dropA);
+      shadowed(b.forward, dropB);
+      shadowed(b.reverse, dropB);
+      // An entry may clash both by key and by value
+      std::sort(dropA.begin(), dropA.end());
+      dropA.erase(std::unique(dropA.begin(), dropA.end()), dropA.end());
+      std::sort(dropB.begin(), dropB.end());
+      dropB.erase(std::unique(dropB.begin(), dropB.end()), dropB.end());
     }
+    QVector<QPair<ForwardFirst, HFBiMapSecond<Value> > > forwardA, forwardB;
+    QVector<Entry> createdA, createdB;
+    take(a, moveA, dropA, 0, forwardA, createdA);
+    take(b, moveB, dropB, a.id, forwardB, createdB);
+    QVector<QPair<ForwardFirst, HFBiMapSecond<Value> > > forwardItems;
+    forwardItems.reserve(forwardA.size()+forwardB.size());
+    std::merge(forwardA.constBegin(), forwardA.constEnd(), forwardB.constBegin(), forwardB.constEnd(), std::back_inserter(forwardItems), &HFBiMapData<Key,Value,Storage>::itemLess<QPair<ForwardFirst, HFBiMapSecond<Value> > >);
+    fill(forward, forwardItems);
+    QVector<QPair<ReverseFirst, HFBiMapSecond<Key> > > reverseA, reverseB, reverseItems;
+    relink(a.reverse, createdA, 0, reverseA);
+    relink(b.reverse, createdB, a.id, reverseB);
+    reverseItems.reserve(reverseA.size()+reverseB.size());
+    std::merge(reverseA.constBegin(), reverseA.constEnd(), reverseB.constBegin(), reverseB.constEnd(), std::back_inserter(reverseItems), &HFBiMapData<Key,Value,Storage>::itemLess<QPair<ReverseFirst, HFBiMapSecond<Key> > >);
+    fill(reverse, reverseItems);
+    id=a.id+b.id;
+    relinked();
   }
-  ~HFBiMapData() { clear(); }
-  QMap<HFBiMapFirst<Key>, HFBiMapSecond<Value> > forward;
-  QMap<HFBiMapFirst<Value>, HFBiMapSecond<Key> > reverse;
-  quint64 id;
-  void clear(){
-    for(auto it=forward.begin(); it!=forward.end(); it++)
+  template <class Item> static inline bool itemLess(const Item &a, const Item &b) { return qMapLessThanKey(a.first, b.first); }
+  // Appends to ids those of the entries of index a whose key (value) is also in index b
+  template <class Index> static void shared(const Index &a, const Index &b, QVector<quint64> &ids)
+  {
+    auto i=a.constBegin(), j=b.constBegin();
+    while(i!=a.constEnd() && j!=b.constEnd())
     {
-      delete (const Key*)it.key();
-      delete (Value*)it.value();
+      if(qMapLessThanKey(*i.key().d, *j.key().d))
+        ++i;
+      else if(qMapLessThanKey(*j.key().d, *i.key().d))
+        ++j;
+      else
+        ids.append((i++).key().id);
     }
-    forward.clear();
-    reverse.clear();
+  }
+  // Appends to ids those of the entries of index having the same key (value) as a later one
+  template <class Index> static void shadowed(const Index &index, QVector<quint64> &ids)
+  {
+    for(auto i=index.constBegin(), previous=i;i!=index.constEnd();previous=i++)
+    {
+      if(i!=index.constBegin() && !qMapLessThanKey(*previous.key().d, *i.key().d))
+        ids.append(i.key().id);
+    }
+  }
+  // Creates in storage the entries of source whose ids are not in drop, with ids moved by offset, in the order of the forward index;
+  // created gets them sorted by their id in source
+  template <class Items> void take(const HFBiMapData<Key,Value,Storage> &source, bool move, const QVector<quint64> &drop, quint64 offset, Items &items, QVector<Entry> &created)
+  {
+    items.reserve(source.forward.size()-drop.size());
+    created.reserve(source.forward.size()-drop.size());
+    for(auto it=source.forward.constBegin();it!=source.forward.constEnd();++it)
+    {
+      if(std::binary_search(drop.constBegin(), drop.constEnd(), it.key().id))
+        continue;
+      QPair<Key *, Value *> entry=move && !HFBiMapStorageShares<Storage>::value?
+            storage.create(std::move(*const_cast<Key *>(it.key().d)), std::move(*it.value().d)):storage.create(*it.key().d, *it.value().d);
+      items.append(qMakePair(forwardFirst(entry.first, it.key().id+offset), HFBiMapSecond<Value>(entry.second)));
+      created.append({entry.first, entry.second, it.key().id});
+    }
+    std::sort(created.begin(), created.end(), [](const Entry &a, const Entry &b) { return a.id<b.id; });
+  }
+  // Reverse index items of the entries created by take, in the order of the reverse index of their source
+  template <class Index, class Items> void relink(const Index &source, const QVector<Entry> &created, quint64 offset, Items &items) const
+  {
+    items.reserve(created.size());
+    for(auto it=source.constBegin();it!=source.constEnd();++it)
+    {
+      auto entry=std::lower_bound(created.constBegin(), created.constEnd(), it.key().id, [](const Entry &a, quint64 id) { return a.id<id; });
+      if(entry!=created.constEnd() && entry->id==it.key().id)
+        items.append(qMakePair(reverseFirst(entry->value, entry->id+offset), HFBiMapSecond<Key>(const_cast<Key *>(entry->key))));
+    }
+  }
+  // Fills the empty index with items, which are sorted, from the last one as in build
+  template <class Index, class Items> static void fill(Index &index, const Items &items)
+  {
+    for(int i=items.size()-1;i>=0;i--)
+      index.insertMulti(index.constBegin(), items.at(i).first, items.at(i).second);
+  }
+  // Fills the empty indexes with entries created by storage, numbering them as if they had been added one at a time in order
+  // with insertMulti, or with insert when unique is set (an entry is then dropped if a later one reuses its key or its value).
+  // Both indexes are filled from sorted data, so no search is done besides the sorts, which are skipped if the input is already sorted.
+  // From ParallelMinimum entries on, the two indexes are sorted and filled on two threads at once, and each sort is itself split among
+  // half of the cores (see HFBiMapParallel::sort).
+  void build(const QVector<QPair<Key *, Value *> > &entries, bool unique)
+  {
+    int n=entries.size();
+    int threads=HFBiMapParallel::threads();
+    bool parallel=Statistics::Concurrent && n>=ParallelMinimum && threads>1;
+    QVector<int> byKey(n), byValue(n);
+    for(int i=0;i<n;i++)
+      byKey[i]=byValue[i]=i;
+    // Same order as qMapLessThanKey on HFBiMapFirst: the latest entry comes first among equal ones
+    auto keyLess=[&entries](int a, int b) { return qMapLessThanKey(*entries[a].first, *entries[b].first) || (!qMapLessThanKey(*entries[b].first, *entries[a].first) && a>b); };
+    auto valueLess=[&entries](int a, int b) { return qMapLessThanKey(*entries[a].second, *entries[b].second) || (!qMapLessThanKey(*entries[b].second, *entries[a].second) && a>b); };
+    auto sortKeys=[&byKey, &keyLess](int cores) {
+      if(!std::is_sorted(byKey.begin(), byKey.end(), keyLess))
+        HFBiMapParallel::sort(byKey.begin(), byKey.end(), keyLess, cores);
+    };
+    auto sortValues=[&byValue, &valueLess](int cores) {
+      if(!std::is_sorted(byValue.begin(), byValue.end(), valueLess))
+        HFBiMapParallel::sort(byValue.begin(), byValue.end(), valueLess, cores);
+    };
+    if(parallel)
+      HFBiMapParallel::each(2, [&](int i) { if(i) sortKeys(threads-threads/2); else sortValues(threads/2); });
+    else
+    {
+      sortKeys(1);
+      sortValues(1);
+    }
+    QVector<bool> alive(n, true);
+    if(unique)
+    {
+      for(int i=1;i<n;i++)
+      {
+        if(!qMapLessThanKey(*entries[byKey[i-1]].first, *entries[byKey[i]].first))
+          alive[byKey[i]]=false;
+        if(!qMapLessThanKey(*entries[byValue[i-1]].second, *entries[byValue[i]].second))
+          alive[byValue[i]]=false;
+      }
+      for(int i=0;i<n;i++)
+      {
+        if(!alive[i])
+          storage.destroy(entries[i].first, entries[i].second);
+      }
+    }
+    // Feeding QMap from the largest element with constBegin() as hint makes every insertion amortized constant time
+    auto fillForward=[&]() {
+      for(int i=n-1;i>=0;i--)
+      {
+        int e=byKey.at(i);
+        if(alive.at(e))
+          forward.insertMulti(forward.constBegin(), forwardFirst(entries[e].first, id+e+1), entries[e].second);
+      }
+    };
+    auto fillReverse=[&]() {
+      for(int i=n-1;i>=0;i--)
+      {
+        int e=byValue.at(i);
+        if(alive.at(e))
+          reverse.insertMulti(reverse.constBegin(), reverseFirst(entries[e].second, id+e+1), entries[e].first);
+      }
+    };
+    if(parallel)
+      HFBiMapParallel::each(2, [&](int i) { if(i) fillForward(); else fillReverse(); });
+    else
+    {
+      fillForward();
+      fillReverse();
+    }
+    id+=n;
+    relinked();
   }
 };
 template <class T> inline bool qMapLessThanKey(const HFBiMapFirst<T> &key1, const HFBiMapFirst<T> &key2)
 {
-  bool less=qMapLessThanKey((*key1), (*key2)), more=qMapLessThanKey((*key2), (*key1));
-  return less || (!more && key1.id>key2.id);
+  // A probe is never equal to an entry
+  if(key1.isProbe())
+    return key1.probe()->before(*key2.d);
+  if(key2.isProbe())
+    return !key2.probe()->before(*key1.d);
+  int compare=HFBiMapCompare<T>::compare(*key1.d, *key2.d);
+  return compare<0 || (compare==0 && key1.id>key2.id);
+}
+template <class T> inline bool qMapLessThanKey(const HFBiMapPrefixedFirst<T> &key1, const HFBiMapPrefixedFirst<T> &key2)
+{
+  if(key1.prefix!=key2.prefix && !key1.isProbe() && !key2.isProbe())
+    return key1.prefix<key2.prefix;
+  return qMapLessThanKey(static_cast<const HFBiMapFirst<T> &>(key1), static_cast<const HFBiMapFirst<T> &>(key2));
+}
+template <class T> inline bool qMapLessThanKey(const HFBiMapCountedFirst<T> &key1, const HFBiMapCountedFirst<T> &key2)
+{
+  (key1.stats?key1.stats:key2.stats)->comparisons++;
+  return qMapLessThanKey(static_cast<const HFBiMapFirst<T> &>(key1), static_cast<const HFBiMapFirst<T> &>(key2));
 }
 
 /** This class provides all the functions of QMap but has simmetrical behaviour regarding Value->Key association.
- *
+ * Storage decides how the key and value of each entry are allocated (see HFBiMapHeapStorage and HFBiMapPoolStorage).
  */
-template <class Key, class Value> class HFBiMap
+template <class Key, class Value, class Storage = HFBiMapHeapStorage<Key, Value> > class HFBiMap
 {
 public:
-  typedef HFBiMapFirst<Key> ForwardFirst;
-  typedef HFBiMapFirst<Value> ReverseFirst;
+  typedef typename HFBiMapData<Key, Value, Storage>::ForwardFirst ForwardFirst;
+  typedef typename HFBiMapData<Key, Value, Storage>::ReverseFirst ReverseFirst;
   typedef HFBiMapSecond<Value> ForwardSecond;
   typedef HFBiMapSecond<Key> ReverseSecond;
 
   class iterator
   {
-    friend class HFBiMap<Key,Value>;
+    friend class HFBiMap<Key,Value,Storage>;
   protected:
     bool m_isForward;
     typename QMap<ForwardFirst, ForwardSecond >::iterator m_forwardIt;
@@ -96,17 +1257,18 @@ public:
 
     inline iterator &operator++() { if(m_isForward)m_forwardIt++; else m_reverseIt++; return *this; }
     inline iterator operator++(int) { iterator r=*this; if(m_isForward)m_forwardIt++; else m_reverseIt++; return r; }
-    inline iterator &operator--() { if(m_isForward)m_forwardIt++; else m_reverseIt++; return *this; }
+    inline iterator &operator--() { if(m_isForward)m_forwardIt--; else m_reverseIt--; return *this; }
     inline iterator operator--(int) { iterator r=*this; if(m_isForward)m_forwardIt--; else m_reverseIt--; return r; }
-    inline iterator operator+(int j) { auto r=*this; if(m_isForward)r->m_forwardIt+=j; else r->m_reverseIt+=j; return r; }
-    inline iterator operator-(int j) { auto r=*this; if(m_isForward)r->m_forwardIt-=j; else r->m_reverseIt-=j; return r; }
+    // QMap moves one node at a time, so these take O(j); HFBiPersistentMap and HFBiFlatMap do it in O(log n)
+    inline iterator operator+(int j) const { auto r=*this; r+=j; return r; }
+    inline iterator operator-(int j) const { auto r=*this; r-=j; return r; }
     inline iterator &operator+=(int j) { if(m_isForward)m_forwardIt+=j; else m_reverseIt+=j; return *this; }
     inline iterator &operator-=(int j) { if(m_isForward)m_forwardIt-=j; else m_reverseIt-=j; return *this; }
   };
 
   class const_iterator
   {
-    friend class HFBiMap<Key,Value>;
+    friend class HFBiMap<Key,Value,Storage>;
   protected:
     bool m_isForward;
     typename QMap<ForwardFirst, ForwardSecond >::const_iterator m_forwardIt;
@@ -132,32 +1294,54 @@ public:
 
     inline const_iterator &operator++() { if(m_isForward)m_forwardIt++; else m_reverseIt++; return *this; }
     inline const_iterator operator++(int) { const_iterator r=*this; if(m_isForward)m_forwardIt++; else m_reverseIt++; return r; }
-    inline const_iterator &operator--() { if(m_isForward)m_forwardIt++; else m_reverseIt++; return *this; }
+    inline const_iterator &operator--() { if(m_isForward)m_forwardIt--; else m_reverseIt--; return *this; }
     inline const_iterator operator--(int) { const_iterator r=*this; if(m_isForward)m_forwardIt--; else m_reverseIt--; return r; }
-    inline const_iterator operator+(int j) { auto r=*this; if(m_isForward)r->m_forwardIt+=j; else r->m_reverseIt+=j; return r; }
-    inline const_iterator operator-(int j) { auto r=*this; if(m_isForward)r->m_forwardIt-=j; else r->m_reverseIt-=j; return r; }
+    // QMap moves one node at a time, so these take O(j); HFBiPersistentMap and HFBiFlatMap do it in O(log n)
+    inline const_iterator operator+(int j) const { auto r=*this; r+=j; return r; }
+    inline const_iterator operator-(int j) const { auto r=*this; r-=j; return r; }
     inline const_iterator &operator+=(int j) { if(m_isForward)m_forwardIt+=j; else m_reverseIt+=j; return *this; }
     inline const_iterator &operator-=(int j) { if(m_isForward)m_forwardIt-=j; else m_reverseIt-=j; return *this; }
   };
 
-  HFBiMap(): m_data(new HFBiMapData<Key,Value>()) { }
-  HFBiMap(HFBiMap<Key, Value> &&other) { swap(other); }
-  HFBiMap(const HFBiMap<Key, Value> &other) = default;
-  inline HFBiMap(std::initializer_list<std::pair<Key,Value> > list): m_data(new HFBiMapData<Key,Value>())
+  HFBiMap(): m_data(new HFBiMapData<Key,Value,Storage>()) { }
+  // Entries are created by a copy of storage, e.g. to pass a stateful allocator to HFBiMapAllocatorStorage
+  explicit HFBiMap(const Storage &storage): m_data(new HFBiMapData<Key,Value,Storage>(storage)) { }
+  // other is left empty, with a copy of its storage: storages need not be default constructible (e.g. HFBiMapArenaAllocator)
+  // other is left empty, its storage forgetting the entries moved to this map (e.g. a cache would evict them)
+  HFBiMap(HFBiMap<Key, Value, Storage> &&other): m_data(other.m_data.constData()->blank())
+  {
+    swap(other);
+    other.m_data->cleared();
+  }
+  HFBiMap(const HFBiMap<Key, Value, Storage> &other) = default;
+  inline HFBiMap(std::initializer_list<std::pair<Key,Value> > list): m_data(new HFBiMapData<Key,Value,Storage>())
+  {
+    assign(list.begin(), list.end());
+  }
+  template <class InputIterator> inline HFBiMap(InputIterator first, InputIterator last): m_data(new HFBiMapData<Key,Value,Storage>())
   {
-    for (typename std::initializer_list<std::pair<Key,Value> >::const_iterator it = list.begin(); it != list.end(); ++it)
-      insert(it->first, it->second);
+    assign(first, last);
   }
-  HFBiMap<Key, Value> &operator=(HFBiMap<Key, Value> &&other) { m_data.swap(other); }
-  HFBiMap<Key, Value> &operator=(const HFBiMap<Key, Value> &other) = default;
+  HFBiMap<Key, Value, Storage> &operator=(HFBiMap<Key, Value, Storage> &&other) { m_data.swap(other.m_data); return *this; }
+  HFBiMap<Key, Value, Storage> &operator=(const HFBiMap<Key, Value, Storage> &other) = default;
 
+  // Replaces the content with the pairs in [first, last), giving the same result as inserting them in order with insert
+  template <class InputIterator> inline void assign(InputIterator first, InputIterator last) { build(first, last, true); }
+  // As above for all the pairs of container, which are moved from if container is an rvalue
+  template <class Container> inline void assign(Container &&container) { buildFrom(std::forward<Container>(container), true); }
+  // There is no at(i) or rank(key): QMap nodes don't know the size of their subtrees, so both would walk the map.
+  // HFBiPersistentMap and HFBiFlatMap (see freeze) answer them in O(log n) and O(1), and suit paging through large maps.
   inline iterator begin() { return createForward(m_data->forward.begin()); }
   inline const_iterator begin() const { return constBegin(); }
   inline const_iterator cbegin() const { return constBegin(); }
   inline iterator beginValue() { return createReverse(m_data->reverse.begin()); }
   inline const_iterator beginValue() const { return constBeginValue(); }
   inline const_iterator cbeginValue() const { return constBeginValue(); }
-  inline void clear() { m_data->clear(); }
+  inline void clear()
+  {
+    m_data->cleared();
+    m_data->clear();
+  }
   inline bool contains(const Key &key) const
   {
     auto it=m_data->forward.lowerBound({&key, std::numeric_limits<quint64>::max()-1});
@@ -189,9 +1373,9 @@ public:
         const Key *key=pos.m_forwardIt.key();
         const Value *value=pos.m_forwardIt.value();
         m_data->reverse.remove({value, pos.m_forwardIt.key().id});
+        m_data->unlinked(key, value, pos.m_forwardIt.key().id);
         pos.m_forwardIt=m_data->forward.erase(pos.m_forwardIt);
-        delete key;
-        delete value;
+        m_data->storage.destroy(key, value);
       }
     }
     else {
@@ -200,57 +1384,114 @@ public:
         const Key *key=pos.m_reverseIt.value();
         const Value *value=pos.m_reverseIt.key();
         m_data->forward.remove({key, pos.m_reverseIt.key().id});
+        m_data->unlinked(key, value, pos.m_reverseIt.key().id);
         pos.m_reverseIt=m_data->reverse.erase(pos.m_reverseIt);
-        delete key;
-        delete value;
+        m_data->storage.destroy(key, value);
       }
     };
     return pos;
   }
+  // Removes the entries in [first, last), which must both walk the keys or both the values, returning the iterator that was at last
+  iterator erase(iterator first, iterator last)
+  {
+    QVector<Entry> doomed;
+    for(;first!=last;++first)
+      doomed.append({&first.key(), &first.value(), quint64(first.id())});
+    bool atEnd=last.m_isForward?last.m_forwardIt==m_data->forward.end():last.m_reverseIt==m_data->reverse.end();
+    const Key *key=atEnd?nullptr:&last.key();
+    const Value *value=atEnd?nullptr:&last.value();
+    quint64 id=atEnd?0:quint64(last.id());
+    m_data->unlink(doomed);
+    // Indexes may have been rebuilt, so last is looked up again
+    if(last.m_isForward)
+      return createForward(atEnd?m_data->forward.end():m_data->forward.find(m_data->forwardFirst(key, id)));
+    return createReverse(atEnd?m_data->reverse.end():m_data->reverse.find(m_data->reverseFirst(value, id)));
+  }
+  // Entries holding key, from first to second (excluded) in the order of keys, found in O(log n)
+  inline QPair<iterator, iterator> equalRange(const Key &key) { return qMakePair(lowerBound(key), upperBound(key)); }
+  inline QPair<const_iterator, const_iterator> equalRange(const Key &key) const { return qMakePair(lowerBound(key), upperBound(key)); }
+  // Entries holding value, in the order of values
+  inline QPair<iterator, iterator> equalRangeValue(const Value &value) { return qMakePair(lowerBoundValue(value), upperBoundValue(value)); }
+  inline QPair<const_iterator, const_iterator> equalRangeValue(const Value &value) const { return qMakePair(lowerBoundValue(value), upperBoundValue(value)); }
   inline iterator find(const Key &key) {
     auto it=m_data->forward.lowerBound({&key, std::numeric_limits<quint64>::max()-1});
-    return createForward(it!=m_data->forward.end() && !qMapLessThanKey(key,*it.key().d)?it:m_data->forward.end());
+    return createForward(accessed(it!=m_data->forward.end() && !qMapLessThanKey(key,*it.key().d)?it:m_data->forward.end(), m_data->forward.end()));
   }
   inline const_iterator findConst(const Key &key) const {
+    touching();
     auto it=m_data->forward.lowerBound({&key, std::numeric_limits<quint64>::max()-1});
-    return createForward(it!=m_data->forward.end() && !qMapLessThanKey(key,*it.key().d)?it:m_data->forward.end());
+    return createForward(accessed(it!=m_data->forward.end() && !qMapLessThanKey(key,*it.key().d)?it:m_data->forward.end(), m_data->forward.end()));
   }
   inline iterator findValue(const Value &value) {
     auto it=m_data->reverse.lowerBound({&value, std::numeric_limits<quint64>::max()-1});
-    return createReverse(it!=m_data->reverse.end() && !qMapLessThanKey(value,*it.key().d)?it:m_data->reverse.end());
+    return createReverse(accessed(it!=m_data->reverse.end() && !qMapLessThanKey(value,*it.key().d)?it:m_data->reverse.end(), m_data->reverse.end()));
   }
   inline const_iterator findValueConst(const Value &value) const {
+    touching();
     auto it=m_data->reverse.lowerBound({&value, std::numeric_limits<quint64>::max()-1});
-    return createReverse(it!=m_data->reverse.end() && !qMapLessThanKey(value,*it.key().d)?it:m_data->reverse.end());
+    return createReverse(accessed(it!=m_data->reverse.end() && !qMapLessThanKey(value,*it.key().d)?it:m_data->reverse.end(), m_data->reverse.end()));
   }
-  inline const Key &firstKey() const {return *m_data->forward.firstKey();}
-  inline const Value &firstValue() const {return *m_data->reverse.firstKey();}
-  inline void insert(const Key &key, const Value &value)
+  // Looks up a batch of keys, returning for each of them (in the same order) what findConst would. Keys are resolved in sorted order,
+  // each search starting from where the previous one ended, so a dense batch costs about a single sweep of the map.
+  template <class Container> QVector<const_iterator> findMany(const Container &keys) const
   {
-    remove(key);
-    removeValue(value);
-    insertMulti(key, value);
+    touching();
+    auto found=sweep(m_data->forward, keys);
+    QVector<const_iterator> ret;
+    ret.reserve(found.size());
+    for(auto it=found.constBegin();it!=found.constEnd();++it)
+      ret.append(createForward(accessed(*it, m_data->forward.constEnd())));
+    return ret;
   }
-  // Allows multiple entries with same key to exist, but not multiple values
-  inline void insertMultiKey(const Key &key, const Value &value)
+  // As findMany, looking up values as findValueConst would
+  template <class Container> QVector<const_iterator> findManyValues(const Container &values) const
   {
-    removeValue(value);
-    insertMulti(key, value);
+    touching();
+    auto found=sweep(m_data->reverse, values);
+    QVector<const_iterator> ret;
+    ret.reserve(found.size());
+    for(auto it=found.constBegin();it!=found.constEnd();++it)
+      ret.append(createReverse(accessed(*it, m_data->reverse.constEnd())));
+    return ret;
   }
-  // Allows multiple entries with same valuev to exist, but not multiple keys
-  inline void insertMultiValue(const Key &key, const Value &value)
+  inline const Key &firstKey() const {return *m_data->forward.firstKey();}
+  // Read-only flat copy of the map, see hfbiflatmap.h
+  inline HFBiFlatMap<Key, Value> freeze() const { return HFBiFlatMap<Key, Value>(*this); }
+  inline const Value &firstValue() const {return *m_data->reverse.firstKey();}
+  // Constructs the value in place from args, then behaves as insert
+  template <class... Args> inline iterator emplace(const Key &key, Args&&... args) { return emplaceUnique(m_data->storage.create(key, std::forward<Args>(args)...)); }
+  template <class... Args> inline iterator emplace(Key &&key, Args&&... args) { return emplaceUnique(m_data->storage.create(std::move(key), std::forward<Args>(args)...)); }
+  // Constructs the key from the elements of keyArgs and the value from those of valueArgs (see std::forward_as_tuple) in place
+  template <class... KeyArgs, class... ValueArgs> inline iterator emplace(std::piecewise_construct_t, std::tuple<KeyArgs...> keyArgs, std::tuple<ValueArgs...> valueArgs)
   {
-    remove(key);
-    insertMulti(key, value);
+    return emplaceUnique(createInPlace(keyArgs, valueArgs, typename HFBiMapMakeIndices<sizeof...(ValueArgs)>::Type()));
   }
-  inline void insertMulti(const Key &key, const Value &value)
+  // Constructs the value (or both key and value) in place, then behaves as insertMulti
+  template <class... Args> inline iterator emplaceMulti(const Key &key, Args&&... args) { return link(m_data->storage.create(key, std::forward<Args>(args)...)); }
+  template <class... Args> inline iterator emplaceMulti(Key &&key, Args&&... args) { return link(m_data->storage.create(std::move(key), std::forward<Args>(args)...)); }
+  template <class... KeyArgs, class... ValueArgs> inline iterator emplaceMulti(std::piecewise_construct_t, std::tuple<KeyArgs...> keyArgs, std::tuple<ValueArgs...> valueArgs)
   {
-    Key *keyCopy=new Key(key);
-    Value *valueCopy=new Value(value);
-    quint64 id=++m_data->id;
-    m_data->forward.insertMulti({keyCopy, id}, valueCopy);
-    m_data->reverse.insertMulti({valueCopy, id}, keyCopy);
+    return link(createInPlace(keyArgs, valueArgs, typename HFBiMapMakeIndices<sizeof...(ValueArgs)>::Type()));
   }
+  // The insertions move from key and value when they are rvalues, and copy them otherwise
+  inline void insert(const Key &key, const Value &value) { put(key, value, true, true); }
+  inline void insert(const Key &key, Value &&value) { put(key, std::move(value), true, true); }
+  inline void insert(Key &&key, const Value &value) { put(std::move(key), value, true, true); }
+  inline void insert(Key &&key, Value &&value) { put(std::move(key), std::move(value), true, true); }
+  // Allows multiple entries with same key to exist, but not multiple values
+  inline void insertMultiKey(const Key &key, const Value &value) { put(key, value, false, true); }
+  inline void insertMultiKey(const Key &key, Value &&value) { put(key, std::move(value), false, true); }
+  inline void insertMultiKey(Key &&key, const Value &value) { put(std::move(key), value, false, true); }
+  inline void insertMultiKey(Key &&key, Value &&value) { put(std::move(key), std::move(value), false, true); }
+  // Allows multiple entries with same valuev to exist, but not multiple keys
+  inline void insertMultiValue(const Key &key, const Value &value) { put(key, value, true, false); }
+  inline void insertMultiValue(const Key &key, Value &&value) { put(key, std::move(value), true, false); }
+  inline void insertMultiValue(Key &&key, const Value &value) { put(std::move(key), value, true, false); }
+  inline void insertMultiValue(Key &&key, Value &&value) { put(std::move(key), std::move(value), true, false); }
+  inline void insertMulti(const Key &key, const Value &value) { link(m_data->storage.create(key, value)); }
+  inline void insertMulti(const Key &key, Value &&value) { link(m_data->storage.create(key, std::move(value))); }
+  inline void insertMulti(Key &&key, const Value &value) { link(m_data->storage.create(std::move(key), value)); }
+  inline void insertMulti(Key &&key, Value &&value) { link(m_data->storage.create(std::move(key), std::move(value))); }
   inline bool isEmpty() const { return m_data->forward.isEmpty(); }
   inline const Key key(const Value &value, const Key &defaultKey = Key()) const
   {
@@ -265,37 +1506,80 @@ public:
   inline iterator lowerBoundValue(const Value &value) { return createReverse(m_data->reverse.lowerBound({(Value *)&value, std::numeric_limits<quint64>::max()-1})); }
   inline const_iterator lowerBoundValue(const Value &value) const { return createReverse(m_data->reverse.lowerBound({(Value *)&value, std::numeric_limits<quint64>::max()-1})); }
   inline int remove(const Key &key) {
-    int ret=0;
-    auto it=m_data->forward.lowerBound({&key, std::numeric_limits<quint64>::max()-1});
-    for(;it!=m_data->forward.end() && !qMapLessThanKey(key,*it.key().d);)
+    return unlinkRun(m_data->forward.lowerBound({&key, std::numeric_limits<quint64>::max()-1}), m_data->forward.end(), key, &HFBiMapData<Key, Value, Storage>::forwardEntry);
+  }
+  // Removes the entries for which predicate(key, value) is true, returning how many they were
+  template <class Predicate> int removeIf(Predicate predicate)
+  {
+    QVector<Entry> doomed;
+    for(auto it=m_data->forward.constBegin();it!=m_data->forward.constEnd();++it)
     {
-      const Key *key=it.key().d;
-      const Value *value=it.value();
-      m_data->reverse.remove({value, it.key().id});
-      it=m_data->forward.erase(it);
-      delete key;
-      delete value;
-      ret++;
+      if(predicate(*it.key().d, *it.value().d))
+        doomed.append({it.key().d, it.value().d, it.key().id});
     }
-    return ret;
+    scanned(size());
+    return m_data->unlink(doomed);
+  }
+  // Removes the entries whose key goes from low to high, both included
+  inline int removeRange(const Key &low, const Key &high)
+  {
+    return unlinkRun(m_data->forward.lowerBound({&low, std::numeric_limits<quint64>::max()-1}), m_data->forward.end(), high, &HFBiMapData<Key, Value, Storage>::forwardEntry);
   }
   inline int removeValue(const Value &value) {
-    int ret=0;
-    auto it=m_data->reverse.lowerBound({&value, std::numeric_limits<quint64>::max()-1});
-    for(;it!=m_data->reverse.end() && !qMapLessThanKey(value,*it.key().d);)
+    return unlinkRun(m_data->reverse.lowerBound({&value, std::numeric_limits<quint64>::max()-1}), m_data->reverse.end(), value, &HFBiMapData<Key, Value, Storage>::reverseEntry);
+  }
+  // Removes the entries whose value goes from low to high, both included
+  inline int removeValueRange(const Value &low, const Value &high)
+  {
+    return unlinkRun(m_data->reverse.lowerBound({&low, std::numeric_limits<quint64>::max()-1}), m_data->reverse.end(), high, &HFBiMapData<Key, Value, Storage>::reverseEntry);
+  }
+  inline int size() const {return m_data->forward.size();}
+  // Counters of the map, all zero unless Storage is a HFBiMapStatsStorage or a HFBiMapCacheStorage
+  inline HFBiMapStats stats() const { return HFBiMapStatistics<Storage>::stats(m_data->storage); }
+  inline void resetStats() { HFBiMapStatistics<Storage>::reset(m_data->storage); }
+  inline void swap(HFBiMap<Key, Value, Storage> &other) { m_data.swap(other.m_data); }
+  // Change journal, only for maps whose Storage is a HFBiMapJournalStorage. The version counts the changes made to the map.
+  inline quint64 version() const { return m_data->storage.version(); }
+  // Changes turning the map as it was at version into the current one. If the journal no longer holds them (see trimJournal), the
+  // delta clears the map and inserts all the current entries instead.
+  HFBiMapDelta<Key, Value> changesSince(quint64 version) const
+  {
+    auto d=m_data.constData();
+    HFBiMapDelta<Key, Value> ret;
+    ret.from=version;
+    ret.to=d->storage.version();
+    if(!d->storage.changesSince(version, ret.changes))
     {
-      const Key *key=it.value();
-      const Value *value=it.key().d;
-      m_data->forward.remove({key, it.key().id});
-      it=m_data->reverse.erase(it);
-      delete key;
-      delete value;
-      ret++;
+      ret.changes.reserve(d->forward.size()+1);
+      ret.changes.append({HFBiMapChange<Key, Value>::Cleared, 0, Key(), Value()});
+      for(auto it=d->forward.constBegin();it!=d->forward.constEnd();++it)
+        ret.changes.append({HFBiMapChange<Key, Value>::Inserted, it.key().id, *it.key().d, *it.value().d});
     }
     return ret;
   }
-  inline int size() const {return m_data->forward.size();}
-  inline void swap(HFBiMap<Key, Value> &other) { m_data.swap(other.m_data); }
+  // Applies a delta taken from a map this one is a replica of, i.e. equal to it (ids included) as it was at delta.from: this map then
+  // equals that one at delta.to. Inserted entries keep their ids, and removed ones are looked up by key and id.
+  void applyDelta(const HFBiMapDelta<Key, Value> &delta)
+  {
+    for(auto it=delta.changes.constBegin();it!=delta.changes.constEnd();++it)
+    {
+      switch(it->type)
+      {
+      case HFBiMapChange<Key, Value>::Inserted:
+        link(m_data->storage.create(it->key, it->value), it->id);
+        m_data->id=qMax(m_data->id, it->id);
+        break;
+      case HFBiMapChange<Key, Value>::Removed:
+        erase(createForward(m_data->forward.find(m_data->forwardFirst(&it->key, it->id))));
+        break;
+      case HFBiMapChange<Key, Value>::Cleared:
+        clear();
+        break;
+      }
+    }
+  }
+  // Forgets the changes up to version, once every consumer has got them
+  inline void trimJournal(quint64 version) { m_data->storage.trim(version); }
   Value take(const Key &key, const Value &defaultValue=Value())
   {
     auto it=find(key);
@@ -308,15 +1592,101 @@ public:
     if(it!=end()) { auto ret=it.key(); erase(it); return ret;}
     return defaultKey;
   }
+  // Inserts only if neither key nor the value built from args are already in the map, leaving existing entries untouched.
+  // Returns the new entry and true, or the entry that prevented the insertion and false. args are not used if key is found.
+  template <class... Args> inline QPair<iterator, bool> tryEmplace(const Key &key, Args&&... args)
+  {
+    auto it=locate(key);
+    return it!=end()?qMakePair(it, false):tryLink(m_data->storage.create(key, std::forward<Args>(args)...));
+  }
+  template <class... Args> inline QPair<iterator, bool> tryEmplace(Key &&key, Args&&... args)
+  {
+    auto it=locate(key);
+    return it!=end()?qMakePair(it, false):tryLink(m_data->storage.create(std::move(key), std::forward<Args>(args)...));
+  }
   inline iterator upperBound(const Key &key) { return createForward(m_data->forward.upperBound({(Key *)&key, 0})); }
+  inline const_iterator upperBound(const Key &key) const { return createForward(m_data->forward.upperBound({(Key *)&key, 0})); }
   inline iterator upperBoundValue(const Value &value) { return createReverse(m_data->reverse.upperBound({(Value *)&value, 0})); }
+  inline const_iterator upperBoundValue(const Value &value) const { return createReverse(m_data->reverse.upperBound({(Value *)&value, 0})); }
   inline const Value value(const Key &key, const Value &defaultValue = Value()) const
   {
     auto it=m_data->forward.lowerBound({&key, std::numeric_limits<quint64>::max()-1});
     return it!=m_data->forward.end() && !qMapLessThanKey(key,*it.key().d)?*it.value():defaultValue;
   }
   inline QList<Value> values() const { QList<Value> ret; Q_FOREACH(auto v, m_data->reverse.keys()) { ret.append(*v); } return ret; }
-  inline bool operator==(const HFBiMap<Key, Value> &other) const {
+  // Heterogeneous lookups: K and V are any type that qMapLessThanKey compares with Key and Value (e.g. QStringView or QLatin1String
+  // for QString), which are searched for as they are, without building a Key or Value
+  template <class K> inline HFBiMapIfComparable<K, Key, bool> contains(const K &key) const
+  {
+    auto it=m_data->forward.lowerBound(HFBiMapProbe<Key>::lower(key));
+    return (it!=m_data->forward.end() && !qMapLessThanKey(key,*it.key().d));
+  }
+  template <class V> inline HFBiMapIfComparable<V, Value, bool> containsValue(const V &value) const
+  {
+    auto it=m_data->reverse.lowerBound(HFBiMapProbe<Value>::lower(value));
+    return (it!=m_data->reverse.end() && !qMapLessThanKey(value,*it.key().d));
+  }
+  template <class K> inline HFBiMapIfComparable<K, Key, iterator> find(const K &key) {
+    auto it=m_data->forward.lowerBound(HFBiMapProbe<Key>::lower(key));
+    return createForward(accessed(it!=m_data->forward.end() && !qMapLessThanKey(key,*it.key().d)?it:m_data->forward.end(), m_data->forward.end()));
+  }
+  template <class K> inline HFBiMapIfComparable<K, Key, const_iterator> findConst(const K &key) const {
+    touching();
+    auto it=m_data->forward.lowerBound(HFBiMapProbe<Key>::lower(key));
+    return createForward(accessed(it!=m_data->forward.end() && !qMapLessThanKey(key,*it.key().d)?it:m_data->forward.end(), m_data->forward.end()));
+  }
+  template <class V> inline HFBiMapIfComparable<V, Value, iterator> findValue(const V &value) {
+    auto it=m_data->reverse.lowerBound(HFBiMapProbe<Value>::lower(value));
+    return createReverse(accessed(it!=m_data->reverse.end() && !qMapLessThanKey(value,*it.key().d)?it:m_data->reverse.end(), m_data->reverse.end()));
+  }
+  template <class V> inline HFBiMapIfComparable<V, Value, const_iterator> findValueConst(const V &value) const {
+    touching();
+    auto it=m_data->reverse.lowerBound(HFBiMapProbe<Value>::lower(value));
+    return createReverse(accessed(it!=m_data->reverse.end() && !qMapLessThanKey(value,*it.key().d)?it:m_data->reverse.end(), m_data->reverse.end()));
+  }
+  template <class V> inline HFBiMapIfComparable<V, Value, const Key> key(const V &value, const Key &defaultKey = Key()) const
+  {
+    auto it=m_data->reverse.lowerBound(HFBiMapProbe<Value>::lower(value));
+    return it!=m_data->reverse.end() && !qMapLessThanKey(value,*it.key().d)?*it.value():defaultKey;
+  }
+  template <class K> inline HFBiMapIfComparable<K, Key, iterator> lowerBound(const K &key) { return createForward(m_data->forward.lowerBound(HFBiMapProbe<Key>::lower(key))); }
+  template <class K> inline HFBiMapIfComparable<K, Key, const_iterator> lowerBound(const K &key) const { return createForward(m_data->forward.lowerBound(HFBiMapProbe<Key>::lower(key))); }
+  template <class V> inline HFBiMapIfComparable<V, Value, iterator> lowerBoundValue(const V &value) { return createReverse(m_data->reverse.lowerBound(HFBiMapProbe<Value>::lower(value))); }
+  template <class V> inline HFBiMapIfComparable<V, Value, const_iterator> lowerBoundValue(const V &value) const { return createReverse(m_data->reverse.lowerBound(HFBiMapProbe<Value>::lower(value))); }
+  template <class K> inline HFBiMapIfComparable<K, Key, iterator> upperBound(const K &key) { return createForward(m_data->forward.upperBound(HFBiMapProbe<Key>::upper(key))); }
+  template <class K> inline HFBiMapIfComparable<K, Key, const_iterator> upperBound(const K &key) const { return createForward(m_data->forward.upperBound(HFBiMapProbe<Key>::upper(key))); }
+  template <class V> inline HFBiMapIfComparable<V, Value, iterator> upperBoundValue(const V &value) { return createReverse(m_data->reverse.upperBound(HFBiMapProbe<Value>::upper(value))); }
+  template <class V> inline HFBiMapIfComparable<V, Value, const_iterator> upperBoundValue(const V &value) const { return createReverse(m_data->reverse.upperBound(HFBiMapProbe<Value>::upper(value))); }
+  template <class K> inline HFBiMapIfComparable<K, Key, const Value> value(const K &key, const Value &defaultValue = Value()) const
+  {
+    auto it=m_data->forward.lowerBound(HFBiMapProbe<Key>::lower(key));
+    return it!=m_data->forward.end() && !qMapLessThanKey(key,*it.key().d)?*it.value():defaultValue;
+  }
+  // Set operations on the entries, seen as pairs of key and value. Both maps are walked in the order of their indexes, taking linear
+  // time instead of a search for every entry.
+
+  // Adds the entries of other as insert would do, in the order they were added to other
+  inline void unite(const HFBiMap<Key, Value, Storage> &other) { combine(*other.m_data.constData(), false, true); }
+  // As unite, moving the entries out of other (if no other map shares them); other is left empty
+  inline void merge(HFBiMap<Key, Value, Storage> &&other)
+  {
+    combine(*other.m_data.constData(), other.m_data.constData()->ref.loadAcquire()==1, true);
+    other.m_data=other.m_data.constData()->blank();
+    other.m_data->cleared();
+  }
+  // Keeps only the entries whose pair is also in other
+  inline void intersect(const HFBiMap<Key, Value, Storage> &other)
+  {
+    QVector<Entry> doomed=pairs(other, false);
+    m_data->unlink(doomed);
+  }
+  // Removes the entries whose pair is also in other
+  inline void subtract(const HFBiMap<Key, Value, Storage> &other)
+  {
+    QVector<Entry> doomed=pairs(other, true);
+    m_data->unlink(doomed);
+  }
+  inline bool operator==(const HFBiMap<Key, Value, Storage> &other) const {
     if(m_data==other.m_data) // Easy case
       return true;
     auto it=m_data->forward.cbegin(), it2=other.m_data->forward.cbegin();
@@ -325,138 +1695,473 @@ public:
       if(*it.key().d!=*it2.key().d || *it.value()!=*it2.value())
         return false;
     }
-    return (it==m_data->forward.cend() && it==other.m_data->forward.cend());
+    return (it==m_data->forward.cend() && it2==other.m_data->forward.cend());
   }
-  inline bool operator!=(const HFBiMap<Key, Value> &other) const { return !(*this==other); }
+  inline bool operator!=(const HFBiMap<Key, Value, Storage> &other) const { return !(*this==other); }
 protected:
-  QSharedDataPointer<HFBiMapData<Key, Value> > m_data;
+  template <class K, class V> friend class HFBiFlatMap;
+  QSharedDataPointer<HFBiMapData<Key, Value, Storage> > m_data;
+  typedef typename HFBiMapData<Key, Value, Storage>::Entry Entry;
+
+  // Removes the entries from it on whose key (value, walking the reverse index) is not greater than high, returning how many they
+  // were. A single entry, as when insert replaces one, is unlinked without allocating a batch.
+  template <class Iterator, class T> int unlinkRun(Iterator it, const Iterator &end, const T &high, Entry (*entry)(const Iterator &))
+  {
+    QVector<Entry> doomed;
+    Entry first={nullptr, nullptr, 0};
+    int n=0;
+    for(;it!=end && !qMapLessThanKey(high,*it.key().d);++it, n++)
+    {
+      if(!n)
+        first=entry(it);
+      else
+      {
+        if(n==1)
+          doomed.append(first);
+        doomed.append(entry(it));
+      }
+    }
+    scanned(n);
+    return n==1?m_data->unlink(first):m_data->unlink(doomed);
+  }
 
   inline iterator createForward(typename QMap<ForwardFirst,ForwardSecond>::iterator iter) { auto it=iterator(true); it.m_forwardIt=iter; it.m_reverseIt=m_data->reverse.end(); return it; }
   inline iterator createReverse(typename QMap<ReverseFirst,ReverseSecond>::iterator iter) { auto it=iterator(false); it.m_reverseIt=iter; it.m_forwardIt=m_data->forward.end(); return it; }
   inline const_iterator createForward(typename QMap<ForwardFirst,ForwardSecond>::const_iterator iter) const { auto it=const_iterator(true); it.m_forwardIt=iter; it.m_reverseIt=m_data->reverse.end(); return it; }
   inline const_iterator createReverse(typename QMap<ReverseFirst,ReverseSecond>::const_iterator iter) const { auto it=const_iterator(false); it.m_reverseIt=iter; it.m_forwardIt=m_data->forward.end(); return it; }
+
+  // Finds every item of items in index (forward or reverse), in sorted order. Each search first walks a few entries from the previous
+  // match, which is enough for dense batches, and starts a new descent from the root only when the next item is farther away.
+  template <class Index, class Container> static QVector<typename Index::const_iterator> sweep(const Index &index, const Container &items)
+  {
+    enum { FingerSteps=8 };
+    typedef typename std::remove_const<typename std::remove_pointer<decltype(index.constBegin().key().d)>::type>::type T;
+    QVector<const T *> item;
+    for(auto it=items.begin();it!=items.end();++it)
+      item.append(&*it);
+    int n=item.size();
+    QVector<int> order(n);
+    for(int i=0;i<n;i++)
+      order[i]=i;
+    auto less=[&item](int a, int b) { return qMapLessThanKey(*item[a], *item[b]); };
+    if(!std::is_sorted(order.begin(), order.end(), less))
+      std::sort(order.begin(), order.end(), less);
+    QVector<typename Index::const_iterator> ret(n, index.constEnd());
+    auto it=index.constBegin();
+    for(int i=0;i<n;i++)
+    {
+      const T &key=*item[order[i]];
+      if(i>0 && !less(order[i-1], order[i]))
+      {
+        // Same item as the previous one
+        ret[order[i]]=ret[order[i-1]];
+        continue;
+      }
+      for(int step=0;step<FingerSteps && it!=index.constEnd() && qMapLessThanKey(*it.key().d, key);step++)
+        ++it;
+      if(it!=index.constEnd() && qMapLessThanKey(*it.key().d, key))
+        it=index.lowerBound({&key, std::numeric_limits<quint64>::max()-1});
+      if(it!=index.constEnd() && !qMapLessThanKey(key, *it.key().d))
+        ret[order[i]]=it;
+    }
+    return ret;
+  }
+  template <class InputIterator> void build(InputIterator first, InputIterator last, bool unique)
+  {
+    // The new data keeps the storage settings (e.g. the allocator), not its entries
+    m_data=m_data.constData()->blank();
+    QVector<QPair<Key *, Value *> > entries;
+    for(;first!=last;++first)
+      entries.append(m_data->storage.create((*first).first, (*first).second));
+    m_data->build(entries, unique);
+  }
+  template <class Container> inline void buildFrom(Container &&container, bool unique)
+  {
+    if(std::is_lvalue_reference<Container>::value)
+      build(container.begin(), container.end(), unique);
+    else
+      build(std::make_move_iterator(container.begin()), std::make_move_iterator(container.end()), unique);
+  }
+  // Replaces the content with the entries of a frozen map, keeping their ids
+  void thawFrom(const HFBiFlatMap<Key, Value> &flat)
+  {
+    m_data=m_data.constData()->blank();
+    auto d=flat.m_data.constData();
+    int n=d->keys.size();
+    QVector<QPair<Key *, Value *> > entries(n);
+    for(int i=n-1;i>=0;i--)
+    {
+      entries[i]=m_data->storage.create(d->keys.at(i), d->values.at(i));
+      m_data->forward.insertMulti(m_data->forward.constBegin(), m_data->forwardFirst(entries[i].first, d->ids.at(i)), entries[i].second);
+    }
+    for(int i=n-1;i>=0;i--)
+    {
+      int e=d->byValue.at(i);
+      m_data->reverse.insertMulti(m_data->reverse.constBegin(), m_data->reverseFirst(entries.at(e).second, d->ids.at(e)), entries.at(e).first);
+    }
+    m_data->id=d->id;
+    m_data->relinked();
+  }
+  // Replaces the content with its union with other, see HFBiMapData::unite
+  void combine(const HFBiMapData<Key,Value,Storage> &other, bool moveOther, bool unique)
+  {
+    QSharedDataPointer<HFBiMapData<Key,Value,Storage> > old(m_data);
+    // The current entries can be moved as well if this map was their only owner (old holds the second reference)
+    bool moveOwn=old.constData()->ref.loadAcquire()==2 && old.constData()!=&other;
+    m_data=old.constData()->blank();
+    m_data->unite(*old.constData(), moveOwn, other, moveOther, unique);
+  }
+  // Entries whose pair of key and value is (found set) or is not in other. Both forward indexes are walked together, and the values
+  // of each key found in other are sorted to look up those of this map among them.
+  QVector<Entry> pairs(const HFBiMap<Key, Value, Storage> &other, bool found)
+  {
+    auto &forward=m_data->forward;
+    auto &otherForward=other.m_data.constData()->forward;
+    auto valueLess=[](const Value *a, const Value *b) { return qMapLessThanKey(*a, *b); };
+    QVector<Entry> ret;
+    QVector<const Value *> values;
+    auto j=otherForward.constBegin();
+    for(auto i=forward.constBegin();i!=forward.constEnd();)
+    {
+      const Key &key=*i.key().d;
+      values.clear();
+      for(;j!=otherForward.constEnd() && qMapLessThanKey(*j.key().d, key);++j) { }
+      for(;j!=otherForward.constEnd() && !qMapLessThanKey(key, *j.key().d);++j)
+        values.append(j.value().d);
+      std::sort(values.begin(), values.end(), valueLess);
+      for(;i!=forward.constEnd() && !qMapLessThanKey(key, *i.key().d);++i)
+      {
+        if(std::binary_search(values.constBegin(), values.constEnd(), i.value().d, valueLess)==found)
+          ret.append({i.key().d, i.value().d, i.key().id});
+      }
+    }
+    return ret;
+  }
+  // Records a walk over count entries sharing a key or value
+  inline void scanned(int count) const { HFBiMapStatistics<Storage>::scanned(m_data->storage, count); }
+  // Detaches the map before a lookup which changes the storage (i.e. of a cache), so that copies sharing its data are not affected
+  inline void touching() const
+  {
+    if(HFBiMapStatistics<Storage>::Touches)
+      const_cast<HFBiMap *>(this)->m_data.detach();
+  }
+  // Records a lookup by find or findValue, if the storage is a cache: it is a miss if it reached end
+  template <class Iterator> inline Iterator accessed(const Iterator &it, const Iterator &end) const
+  {
+    HFBiMapStatistics<Storage>::accessed(m_data->storage, it!=end?it.key().id:0);
+    return it;
+  }
+  // Adds an entry created by the storage to both indexes
+  inline iterator link(const QPair<Key *, Value *> &entry) { return link(entry, ++m_data->id); }
+  // As above, giving the entry an id which no other one has
+  inline iterator link(const QPair<Key *, Value *> &entry, quint64 id)
+  {
+    m_data->evict(entry.first, entry.second);
+    auto it=m_data->forward.insertMulti(m_data->forwardFirst(entry.first, id), entry.second);
+    m_data->reverse.insertMulti(m_data->reverseFirst(entry.second, id), entry.first);
+    m_data->linked(entry.first, entry.second, id);
+    return createForward(it);
+  }
+  // As find and findValue, without counting as a lookup of a cache (see accessed)
+  inline iterator locate(const Key &key)
+  {
+    auto it=m_data->forward.lowerBound({&key, std::numeric_limits<quint64>::max()-1});
+    return createForward(it!=m_data->forward.end() && !qMapLessThanKey(key,*it.key().d)?it:m_data->forward.end());
+  }
+  inline iterator locateValue(const Value &value)
+  {
+    auto it=m_data->reverse.lowerBound({&value, std::numeric_limits<quint64>::max()-1});
+    return createReverse(it!=m_data->reverse.end() && !qMapLessThanKey(value,*it.key().d)?it:m_data->reverse.end());
+  }
+  // Removes the entries clashing with key and value, as requested, then adds the new one
+  template <class K, class V> inline void put(K &&key, V &&value, bool uniqueKey, bool uniqueValue)
+  {
+    if(uniqueKey)
+      remove(key);
+    if(uniqueValue)
+      removeValue(value);
+    insertMulti(std::forward<K>(key), std::forward<V>(value));
+  }
+  template <class... KeyArgs, class... ValueArgs, int... I> inline QPair<Key *, Value *> createInPlace(std::tuple<KeyArgs...> &keyArgs, std::tuple<ValueArgs...> &valueArgs, HFBiMapIndices<I...>)
+  {
+    return m_data->storage.create(HFBiMapInPlace<KeyArgs...>{std::move(keyArgs)}, std::forward<ValueArgs>(std::get<I>(valueArgs))...);
+  }
+  // The entry is not linked yet, so it is safe to use its own key and value to remove the clashing ones
+  inline iterator emplaceUnique(const QPair<Key *, Value *> &entry)
+  {
+    remove(*entry.first);
+    removeValue(*entry.second);
+    return link(entry);
+  }
+  inline QPair<iterator, bool> tryLink(const QPair<Key *, Value *> &entry)
+  {
+    auto it=locateValue(*entry.second);
+    if(it!=endValue())
+    {
+      m_data->storage.destroy(entry.first, entry.second);
+      return qMakePair(it, false);
+    }
+    return qMakePair(link(entry), true);
+  }
 };
 
-template <class Key, class Value> class HFBiMultiMap: public HFBiMap<Key, Value>
+/** Bidirectional map holding any number of entries with the same key or value, the latest ones first. Finding the entries holding a
+ * key or value (equalRange, lowerBound, ...) takes O(log n). QMap keeps no subtree sizes, so the map also counts the entries holding
+ * each key and value, in a map from each distinct one updated as entries are added and removed (a storage keeping the counts itself,
+ * as HFBiMapInternStorage in HFBiInternedMultiMap does, is used instead): count(key) and countValue(value) take O(log m), for the m
+ * distinct keys or values. find(key, value) walks the shorter of the runs holding key and value.
+ */
+template <class Key, class Value, class Storage = HFBiMapHeapStorage<Key, Value> > class HFBiMultiMap: public HFBiMap<Key, Value, Storage>
 {
 protected:
-  using HFBiMap<Key, Value>::m_data;
-  using HFBiMap<Key, Value>::createForward;
-  using HFBiMap<Key, Value>::createReverse;
+  using HFBiMap<Key, Value, Storage>::m_data;
+  using HFBiMap<Key, Value, Storage>::createForward;
+  using HFBiMap<Key, Value, Storage>::createReverse;
+  using HFBiMap<Key, Value, Storage>::scanned;
+  using typename HFBiMap<Key, Value, Storage>::Entry;
 public:
-  inline HFBiMultiMap() {}
-  HFBiMultiMap(const HFBiMultiMap<Key, Value> &other) : HFBiMap<Key, Value>(other) {}
-  HFBiMultiMap(HFBiMultiMap<Key, Value> &&other): HFBiMap<Key, Value>(std::move(other)) {}
+  using typename HFBiMap<Key, Value, Storage>::iterator;
+  using typename HFBiMap<Key, Value, Storage>::const_iterator;
+
+  inline HFBiMultiMap() { counted(); }
+  explicit HFBiMultiMap(const Storage &storage): HFBiMap<Key, Value, Storage>(storage) { counted(); }
+  HFBiMultiMap(const HFBiMultiMap<Key, Value, Storage> &other) : HFBiMap<Key, Value, Storage>(other) {}
+  HFBiMultiMap(HFBiMultiMap<Key, Value, Storage> &&other): HFBiMap<Key, Value, Storage>(std::move(other)) {}
+  HFBiMultiMap<Key, Value, Storage> &operator=(HFBiMultiMap<Key, Value, Storage> &&other) { HFBiMap<Key, Value, Storage>::swap(other); return *this; }
+  HFBiMultiMap<Key, Value, Storage> &operator=(const HFBiMultiMap<Key, Value, Storage> &other) = default;
   inline HFBiMultiMap(std::initializer_list<std::pair<Key,Value> > init)
   {
-    for (typename std::initializer_list<std::pair<Key,Value> >::const_iterator it = init.begin(); it != init.end(); ++it)
-     insert(it->first, it->second);
+    counted();
+    assign(init.begin(), init.end());
   }
-
-  void insert(const Key &key, const Value &value)
+  template <class InputIterator> inline HFBiMultiMap(InputIterator first, InputIterator last)
   {
-    HFBiMap<Key, Value>::insertMulti(key, value);
+    counted();
+    assign(first, last);
   }
-  void replace(const Key &key, const Value &value)
+
+  // Replaces the content with the pairs in [first, last), keeping all of them as insert does
+  template <class InputIterator> inline void assign(InputIterator first, InputIterator last) { HFBiMap<Key, Value, Storage>::build(first, last, false); }
+  // As above for all the pairs of container, which are moved from if container is an rvalue
+  template <class Container> inline void assign(Container &&container) { HFBiMap<Key, Value, Storage>::buildFrom(std::forward<Container>(container), false); }
+  // The new entry never replaces existing ones; key and value are moved from when they are rvalues
+  inline void insert(const Key &key, const Value &value) { HFBiMap<Key, Value, Storage>::insertMulti(key, value); }
+  inline void insert(const Key &key, Value &&value) { HFBiMap<Key, Value, Storage>::insertMulti(key, std::move(value)); }
+  inline void insert(Key &&key, const Value &value) { HFBiMap<Key, Value, Storage>::insertMulti(std::move(key), value); }
+  inline void insert(Key &&key, Value &&value) { HFBiMap<Key, Value, Storage>::insertMulti(std::move(key), std::move(value)); }
+  // As with insert, the new entry never replaces existing ones
+  template <class... Args> inline iterator emplace(const Key &key, Args&&... args) { return HFBiMap<Key, Value, Storage>::emplaceMulti(key, std::forward<Args>(args)...); }
+  template <class... Args> inline iterator emplace(Key &&key, Args&&... args) { return HFBiMap<Key, Value, Storage>::emplaceMulti(std::move(key), std::forward<Args>(args)...); }
+  template <class... KeyArgs, class... ValueArgs> inline iterator emplace(std::piecewise_construct_t, std::tuple<KeyArgs...> keyArgs, std::tuple<ValueArgs...> valueArgs)
   {
-    HFBiMap<Key, Value>::insert(key, value);
+    return HFBiMap<Key, Value, Storage>::emplaceMulti(std::piecewise_construct, std::move(keyArgs), std::move(valueArgs));
   }
-  using typename HFBiMap<Key, Value>::iterator;
-  using typename HFBiMap<Key, Value>::const_iterator;
-  using HFBiMap<Key, Value>::find;
-  using HFBiMap<Key, Value>::findConst;
-  using HFBiMap<Key, Value>::findValue;
-  using HFBiMap<Key, Value>::findValueConst;
-  using HFBiMap<Key, Value>::constEnd;
-  using HFBiMap<Key, Value>::count;
-  using HFBiMap<Key, Value>::lowerBound;
-  using HFBiMap<Key, Value>::lowerBoundValue;
+  // Replaces the entries holding key or value, as HFBiMap::insert does
+  inline void replace(const Key &key, const Value &value) { HFBiMap<Key, Value, Storage>::insert(key, value); }
+  inline void replace(const Key &key, Value &&value) { HFBiMap<Key, Value, Storage>::insert(key, std::move(value)); }
+  inline void replace(Key &&key, const Value &value) { HFBiMap<Key, Value, Storage>::insert(std::move(key), value); }
+  inline void replace(Key &&key, Value &&value) { HFBiMap<Key, Value, Storage>::insert(std::move(key), std::move(value)); }
+  using HFBiMap<Key, Value, Storage>::find;
+  using HFBiMap<Key, Value, Storage>::findConst;
+  using HFBiMap<Key, Value, Storage>::findValue;
+  using HFBiMap<Key, Value, Storage>::findValueConst;
+  using HFBiMap<Key, Value, Storage>::constEnd;
+  using HFBiMap<Key, Value, Storage>::contains;
+  using HFBiMap<Key, Value, Storage>::count;
+  using HFBiMap<Key, Value, Storage>::lowerBound;
+  using HFBiMap<Key, Value, Storage>::lowerBoundValue;
+  using HFBiMap<Key, Value, Storage>::remove;
 
   inline bool contains(const Key &key, const Value &value) const
   {
     return (findConst(key, value)!=constEnd());
   }
-  inline int count(const Key &key) const {
-    auto it=m_data->forward.lowerBound({&key, std::numeric_limits<quint64>::max()-1});
-    int ret=0;
-    for(;it!=m_data->forward.end() && !qMapLessThanKey(key,*it.key().d);++it, ++ret) { }
-    return ret;
-  }
-  inline int countValue(const Value &value) const {
-    auto it=m_data->reverse.lowerBound({&value, std::numeric_limits<quint64>::max()-1});
-    int ret=0;
-    for(;it!=m_data->reverse.end() && !qMapLessThanKey(value,*it.key().d);++it, ++ret) { }
-    return ret;
-  }
+  // O(log m) for the m distinct keys (values), see the class description
+  inline int count(const Key &key) const { return countKey(key, HFBiMapStorageCounts<Storage>()); }
+  inline int countValue(const Value &value) const { return countValue(value, HFBiMapStorageCounts<Storage>()); }
+  // The lookups by key and value walk the shorter of the runs of entries holding key and holding value, see match
   inline iterator find(const Key &key, const Value &value) {
-    auto it=m_data->forward.lowerBound({&key, std::numeric_limits<quint64>::max()-1});
-    for(;it!=m_data->forward.end() && !qMapLessThanKey(key, *it.key());++it)
-    {
-      if(!qMapLessThanKey(*it.value(), value) && !qMapLessThanKey(value, *it.value()))
-        return createForward(it);
-    }
-    return createForward(m_data->forward.end());
+    auto &forward=m_data->forward;
+    Entry entry=match(key, value, {&key, std::numeric_limits<quint64>::max()-1}, {&value, std::numeric_limits<quint64>::max()-1});
+    return createForward(entry.id?forward.find(m_data->forwardFirst(entry.key, entry.id)):forward.end());
   }
   inline const_iterator findConst(const Key &key, const Value &value) const{
-    auto it=m_data->forward.lowerBound({&key, std::numeric_limits<quint64>::max()-1});
-    for(;it!=m_data->forward.end() && !qMapLessThanKey(key, *it.key());++it)
-    {
-      if(!qMapLessThanKey(*it.value(), value) && !qMapLessThanKey(value, *it.value()))
-        return createForward(it);
-    }
-    return createForward(m_data->forward.end());
+    Entry entry=match(key, value, {&key, std::numeric_limits<quint64>::max()-1}, {&value, std::numeric_limits<quint64>::max()-1});
+    return createForward(entry.id?m_data->forward.find(m_data->forwardFirst(entry.key, entry.id)):m_data->forward.end());
   }
   inline iterator findValue(const Value &value, const Key &key) {
-    auto it=m_data->reverse.lowerBound({&value, std::numeric_limits<quint64>::max()-1});
-    for(;it!=m_data->reverse.end() && !qMapLessThanKey(value, *it.key());++it)
-    {
-      if(!qMapLessThanKey(*it.value(), key) && !qMapLessThanKey(key, *it.value()))
-        return createReverse(it);
-    }
-    return createForward(m_data->forward.end());
+    auto &reverse=m_data->reverse;
+    Entry entry=match(key, value, {&key, std::numeric_limits<quint64>::max()-1}, {&value, std::numeric_limits<quint64>::max()-1});
+    return entry.id?createReverse(reverse.find(m_data->reverseFirst(entry.value, entry.id))):createForward(m_data->forward.end());
   }
   inline const_iterator findValueConst(const Value &value, const Key &key) const {
-    auto it=m_data->reverse.lowerBound({&value, std::numeric_limits<quint64>::max()-1});
-    for(;it!=m_data->reverse.end() && !qMapLessThanKey(value, *it.key());++it)
-    {
-      if(!qMapLessThanKey(*it.value(), key) && !qMapLessThanKey(key, *it.value()))
-        return createReverse(it);
-    }
-    return createForward(m_data->forward.end());
+    Entry entry=match(key, value, {&key, std::numeric_limits<quint64>::max()-1}, {&value, std::numeric_limits<quint64>::max()-1});
+    return entry.id?createReverse(m_data->reverse.find(m_data->reverseFirst(entry.value, entry.id))):createForward(m_data->forward.end());
+  }
+  // Heterogeneous lookups, see HFBiMap
+  template <class K, class V> inline HFBiMapIfComparable<K, Key, HFBiMapIfComparable<V, Value, bool> > contains(const K &key, const V &value) const
+  {
+    return (findConst(key, value)!=constEnd());
+  }
+  // The first entry holding key (value) gives the stored one, whose count is then looked up
+  template <class K> inline HFBiMapIfComparable<K, Key, int> count(const K &key) const {
+    auto it=m_data->forward.lowerBound(HFBiMapProbe<Key>::lower(key));
+    return it!=m_data->forward.end() && !qMapLessThanKey(key,*it.key().d)?count(*it.key().d):0;
+  }
+  template <class V> inline HFBiMapIfComparable<V, Value, int> countValue(const V &value) const {
+    auto it=m_data->reverse.lowerBound(HFBiMapProbe<Value>::lower(value));
+    return it!=m_data->reverse.end() && !qMapLessThanKey(value,*it.key().d)?countValue(*it.key().d):0;
+  }
+  template <class K, class V> inline HFBiMapIfComparable<K, Key, HFBiMapIfComparable<V, Value, iterator> > find(const K &key, const V &value) {
+    auto &forward=m_data->forward;
+    Entry entry=match(key, value, HFBiMapProbe<Key>::lower(key), HFBiMapProbe<Value>::lower(value));
+    return createForward(entry.id?forward.find(m_data->forwardFirst(entry.key, entry.id)):forward.end());
+  }
+  template <class K, class V> inline HFBiMapIfComparable<K, Key, HFBiMapIfComparable<V, Value, const_iterator> > findConst(const K &key, const V &value) const {
+    Entry entry=match(key, value, HFBiMapProbe<Key>::lower(key), HFBiMapProbe<Value>::lower(value));
+    return createForward(entry.id?m_data->forward.find(m_data->forwardFirst(entry.key, entry.id)):m_data->forward.end());
+  }
+  template <class V, class K> inline HFBiMapIfComparable<K, Key, HFBiMapIfComparable<V, Value, iterator> > findValue(const V &value, const K &key) {
+    auto &reverse=m_data->reverse;
+    Entry entry=match(key, value, HFBiMapProbe<Key>::lower(key), HFBiMapProbe<Value>::lower(value));
+    return entry.id?createReverse(reverse.find(m_data->reverseFirst(entry.value, entry.id))):createForward(m_data->forward.end());
+  }
+  template <class V, class K> inline HFBiMapIfComparable<K, Key, HFBiMapIfComparable<V, Value, const_iterator> > findValueConst(const V &value, const K &key) const {
+    Entry entry=match(key, value, HFBiMapProbe<Key>::lower(key), HFBiMapProbe<Value>::lower(value));
+    return entry.id?createReverse(m_data->reverse.find(m_data->reverseFirst(entry.value, entry.id))):createForward(m_data->forward.end());
   }
   inline int remove(const Key &key, const Value &value) {
-    int ret=0;
-    auto it=m_data->forward.lowerBound({&key, std::numeric_limits<quint64>::max()-1});
-    for(;it!=m_data->forward.end() && !qMapLessThanKey(key,*it.key().d);)
+    QVector<Entry> doomed;
+    auto &forward=m_data->forward;
+    auto &reverse=m_data->reverse;
+    auto f=forward.lowerBound({&key, std::numeric_limits<quint64>::max()-1});
+    auto r=reverse.lowerBound({&value, std::numeric_limits<quint64>::max()-1});
+    // Every entry to remove is in both runs: step through them together to tell which one is shorter, then collect from that one
+    int visited=0;
+    for(;inRun(f, forward.end(), key) && inRun(r, reverse.end(), value);++f, ++r)
+      visited+=2;
+    if(!inRun(f, forward.end(), key))
     {
-      if(!qMapLessThanKey(value, *it.value()) && !qMapLessThanKey(*it.value(),value))
+      for(f=forward.lowerBound({&key, std::numeric_limits<quint64>::max()-1});inRun(f, forward.end(), key);++f, visited++)
       {
-        const Key *key=it.key().d;
-        const Value *value=it.value();
-        m_data->reverse.remove({value, it.key().id});
-        it=m_data->forward.erase(it);
-        delete key;
-        delete value;
-        ret++;
+        if(same(*f.value().d, value))
+          doomed.append({f.key().d, f.value().d, f.key().id});
       }
     }
-    return ret;
-  }
-  void swap(HFBiMultiMap<Key, Value> &other) { HFBiMap<Key, Value>::swap(other); }
-  HFBiMultiMap<Key,Value> &operator +=(const HFBiMultiMap<Key,Value> &other)
-  {
-    for(auto it=other.m_data->forward.begin();it!=other.m_data->forward.end();it++)
+    else
     {
-      insert(*it.key(), *it.value());
+      for(r=reverse.lowerBound({&value, std::numeric_limits<quint64>::max()-1});inRun(r, reverse.end(), value);++r, visited++)
+      {
+        if(same(*r.value().d, key))
+          doomed.append({r.value().d, r.key().d, r.key().id});
+      }
     }
+    scanned(visited);
+    return m_data->unlink(doomed);
+  }
+  void swap(HFBiMultiMap<Key, Value, Storage> &other) { HFBiMap<Key, Value, Storage>::swap(other); }
+  // Adds all the entries of other, as insert does, in the order they were added to other; see HFBiMap::unite
+  inline void unite(const HFBiMultiMap<Key,Value,Storage> &other) { HFBiMap<Key, Value, Storage>::combine(*other.m_data.constData(), false, false); }
+  // As unite, moving the entries out of other (if no other map shares them); other is left empty
+  inline void merge(HFBiMultiMap<Key,Value,Storage> &&other)
+  {
+    HFBiMap<Key, Value, Storage>::combine(*other.m_data.constData(), other.m_data.constData()->ref.loadAcquire()==1, false);
+    other.m_data=other.m_data.constData()->blank();
+    other.m_data->cleared();
+  }
+  HFBiMultiMap<Key,Value,Storage> &operator +=(const HFBiMultiMap<Key,Value,Storage> &other)
+  {
+    unite(other);
     return *this;
   }
-  HFBiMultiMap<Key,Value> operator +(const HFBiMultiMap<Key,Value> &other) const
+  HFBiMultiMap<Key,Value,Storage> operator +(const HFBiMultiMap<Key,Value,Storage> &other) const
+  {
+    HFBiMultiMap<Key,Value,Storage> ret(m_data.constData()->storage);
+    ret.m_data->unite(*m_data.constData(), false, *other.m_data.constData(), false, false);
+    return ret;
+  }
+protected:
+  // Counts the runs, unless the storage already knows the number of entries holding each key and value
+  inline void counted()
+  {
+    if(!HFBiMapStorageCounts<Storage>::value)
+      m_data->countRuns();
+  }
+  // The number of entries is taken from the storage or from the runs. They are walked only if the map got its data from a map
+  // which doesn't count them, e.g. by assigning a HFBiMap to it through a reference to HFBiMap.
+  inline int countKey(const Key &key, std::true_type) const { return m_data->storage.countKey(key); }
+  inline int countKey(const Key &key, std::false_type) const {
+    if(m_data->runs)
+      return m_data->keyRuns.value(key, 0);
+    auto it=m_data->forward.lowerBound({&key, std::numeric_limits<quint64>::max()-1});
+    int ret=0;
+    for(;it!=m_data->forward.end() && !qMapLessThanKey(key,*it.key().d);++it, ++ret) { }
+    scanned(ret);
+    return ret;
+  }
+  inline int countValue(const Value &value, std::true_type) const { return m_data->storage.countValue(value); }
+  inline int countValue(const Value &value, std::false_type) const {
+    if(m_data->runs)
+      return m_data->valueRuns.value(value, 0);
+    auto it=m_data->reverse.lowerBound({&value, std::numeric_limits<quint64>::max()-1});
+    int ret=0;
+    for(;it!=m_data->reverse.end() && !qMapLessThanKey(value,*it.key().d);++it, ++ret) { }
+    scanned(ret);
+    return ret;
+  }
+  // True while it is among the entries holding t
+  template <class Iterator, class T> static inline bool inRun(const Iterator &it, const Iterator &end, const T &t) { return it!=end && !qMapLessThanKey(t, *it.key().d); }
+  template <class A, class B> static inline bool same(const A &a, const B &b) { return !qMapLessThanKey(a, b) && !qMapLessThanKey(b, a); }
+  // Latest entry holding both key and value, one with id 0 if there is none. The entries holding key (from fromKey, their lower bound)
+  // and those holding value (from fromValue) are walked in step: the entry is in both runs, so the walk stops within the shorter one.
+  template <class K, class V> Entry match(const K &key, const V &value, const typename HFBiMap<Key, Value, Storage>::ForwardFirst &fromKey, const typename HFBiMap<Key, Value, Storage>::ReverseFirst &fromValue) const
   {
-    HFBiMultiMap<Key,Value> ret(*this);
-    ret+=other;
+    auto &forward=m_data->forward;
+    auto &reverse=m_data->reverse;
+    auto f=forward.lowerBound(fromKey);
+    auto r=reverse.lowerBound(fromValue);
+    Entry ret={nullptr, nullptr, 0};
+    int visited=0;
+    for(;inRun(f, forward.end(), key);++f, ++r)
+    {
+      visited++;
+      if(same(*f.value().d, value))
+      {
+        ret={f.key().d, f.value().d, f.key().id};
+        break;
+      }
+      if(!inRun(r, reverse.end(), value))
+        break;
+      visited++;
+      if(same(*r.value().d, key))
+      {
+        ret={r.value().d, r.key().d, r.key().id};
+        break;
+      }
+    }
+    scanned(visited);
     return ret;
   }
 };
 
+// Shorthands for maps whose entries live in a HFBiMapPoolStorage
+template <class Key, class Value> using HFBiPooledMap = HFBiMap<Key, Value, HFBiMapPoolStorage<Key, Value> >;
+template <class Key, class Value> using HFBiPooledMultiMap = HFBiMultiMap<Key, Value, HFBiMapPoolStorage<Key, Value> >;
+// Shorthand for a multi map sharing equal keys and values, see HFBiMapInternStorage
+template <class Key, class Value> using HFBiInternedMultiMap = HFBiMultiMap<Key, Value, HFBiMapInternStorage<Key, Value> >;
+// Shorthands for maps counting their events, see HFBiMapStatsStorage
+template <class Key, class Value> using HFBiStatsMap = HFBiMap<Key, Value, HFBiMapStatsStorage<HFBiMapHeapStorage<Key, Value> > >;
+template <class Key, class Value> using HFBiStatsMultiMap = HFBiMultiMap<Key, Value, HFBiMapStatsStorage<HFBiMapHeapStorage<Key, Value> > >;
+// Shorthands for maps caching the prefixes of their keys and values, see HFBiMapPrefixStorage
+template <class Key, class Value> using HFBiPrefixMap = HFBiMap<Key, Value, HFBiMapPrefixStorage<HFBiMapHeapStorage<Key, Value> > >;
+template <class Key, class Value> using HFBiPrefixMultiMap = HFBiMultiMap<Key, Value, HFBiMapPrefixStorage<HFBiMapHeapStorage<Key, Value> > >;
+// Shorthands for maps keeping a journal of their changes, see HFBiMapJournalStorage
+template <class Key, class Value> using HFBiJournalMap = HFBiMap<Key, Value, HFBiMapJournalStorage<Key, Value> >;
+template <class Key, class Value> using HFBiJournalMultiMap = HFBiMultiMap<Key, Value, HFBiMapJournalStorage<Key, Value> >;
+// Shorthand for a map bounded in size, see HFBiMapCacheStorage
+template <class Key, class Value> using HFBiCacheMap = HFBiMap<Key, Value, HFBiMapCacheStorage<Key, Value> >;
+// Shorthands for maps whose entries come from an allocator, see HFBiMapAllocatorStorage
+template <class Key, class Value, class Allocator = std::allocator<Key> > using HFBiAllocatorMap = HFBiMap<Key, Value, HFBiMapAllocatorStorage<Key, Value, Allocator> >;
+template <class Key, class Value, class Allocator = std::allocator<Key> > using HFBiAllocatorMultiMap = HFBiMultiMap<Key, Value, HFBiMapAllocatorStorage<Key, Value, Allocator> >;
+
 #endif // HFBiMapEx_H
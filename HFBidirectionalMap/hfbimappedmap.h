@@ -0,0 +1,423 @@
+/*
+ * Copyright 2021 Marzocchi Alessandro
+ * All rights reserved. Distributed under the terms of the MIT license.
+ */
+
+#ifndef HFBiMappedMap_Header
+#define HFBiMappedMap_Header
+
+#include <QByteArray>
+#include <QFile>
+#include <QIODevice>
+#include <QString>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <hfbiflatmap.h>
+
+/** How a type is laid out in a snapshot file. Each key or value takes a fixed size Slot inside the file, and a View is what is read back
+ * from it without any copy. Arithmetic types are stored as they are, QStrings as a slice of a shared blob of UTF-16 text.
+ * store() places an object at blob (a size in bytes, advanced past it) and write() appends its part of the blob; valid() checks a slot
+ * read from a file against the size of the blob, so that a corrupt file can't make views point outside of it.
+ */
+template <class T, class Enable = void> struct HFBiMapSnapshotTraits;
+template <class T> struct HFBiMapSnapshotTraits<T, typename std::enable_if<std::is_arithmetic<T>::value>::type>
+{
+  typedef T Slot;
+  typedef T View;
+  static inline Slot store(const T &object, quint64 &) { return object; }
+  template <class Writer> static inline void write(const T &, Writer &) { }
+  static inline bool valid(const Slot &, quint64) { return true; }
+  static inline quint64 maximumBlob() { return std::numeric_limits<quint64>::max(); }
+  static inline View view(const Slot &slot, const char *) { return slot; }
+  static inline T toObject(const View &view) { return view; }
+};
+template <> struct HFBiMapSnapshotTraits<QString>
+{
+  // Offset and size in QChars of the text inside the blob
+  struct Slot { quint32 offset; quint32 size; };
+  typedef QStringView View;
+  static inline Slot store(const QString &object, quint64 &blob)
+  {
+    Slot ret={quint32(blob/sizeof(QChar)), quint32(object.size())};
+    blob+=quint64(object.size())*sizeof(QChar);
+    return ret;
+  }
+  template <class Writer> static inline void write(const QString &object, Writer &writer) { writer.append(reinterpret_cast<const char *>(object.constData()), quint64(object.size())*sizeof(QChar)); }
+  static inline bool valid(const Slot &slot, quint64 blobSize) { return quint64(slot.offset)+slot.size<=blobSize/sizeof(QChar) && slot.size<=quint32(std::numeric_limits<int>::max()); }
+  // Offsets are 32 bits wide
+  static inline quint64 maximumBlob() { return quint64(std::numeric_limits<quint32>::max())*sizeof(QChar); }
+  static inline View view(const Slot &slot, const char *blob) { return QStringView(reinterpret_cast<const QChar *>(blob)+slot.offset, int(slot.size)); }
+  static inline QString toObject(const View &view) { return view.toString(); }
+};
+
+// Buffered sequential writes of a snapshot to a device, remembering whether any of them failed
+struct HFBiMappedMapWriter
+{
+  enum { Chunk=1<<16 };
+  inline explicit HFBiMappedMapWriter(QIODevice *device): device(device), pos(0), ok(true) { buffer.reserve(Chunk); }
+  void append(const char *data, quint64 size)
+  {
+    pos+=size;
+    while(size>0 && ok)
+    {
+      int step=int(qMin<quint64>(size, quint64(Chunk-buffer.size())));
+      buffer.append(data, step);
+      data+=step;
+      size-=quint64(step);
+      if(buffer.size()>=Chunk)
+        flush();
+    }
+  }
+  // Zeroes up to offset, which starts the next section
+  inline void pad(quint64 offset)
+  {
+    static const char padding[8]={};
+    append(padding, offset-pos);
+  }
+  inline bool flush()
+  {
+    if(ok && !buffer.isEmpty())
+      ok=device->write(buffer)==qint64(buffer.size());
+    buffer.clear();
+    return ok;
+  }
+  QIODevice *device;
+  quint64 pos;
+  bool ok;
+  QByteArray buffer;
+};
+
+// Start of a snapshot file. Offsets are from the start of the file, every section being aligned to 8 bytes.
+struct HFBiMappedMapHeader
+{
+  char magic[8];
+  quint32 version;
+  // As written by the machine saving the file, which must have the same byte order as the ones reading it
+  quint32 byteOrder;
+  // Sizes of the slots, rejecting files saved for other types
+  quint32 keySlot, valueSlot;
+  quint64 count, id;
+  quint64 keys, values, ids, byValue, blob, blobSize;
+};
+
+/** Read-only map served directly from a snapshot file mapped in memory, for large tables that would otherwise be rebuilt at every start.
+ * The file holds the same arrays as HFBiFlatMap (keys, values and ids in key order, plus the positions in value order) and
+ * the text of strings, so opening it costs no parsing, only a scan validating the positions: lookups are binary searches on the mapping.
+ * Key and Value must be arithmetic types or QString (see HFBiMapSnapshotTraits); iterators return views of them (e.g. QStringView).
+ * Files are written by save() from any HFBiMap or HFBiFlatMap with the same Key and Value, in the byte order of the machine.
+ */
+template <class Key, class Value> class HFBiMappedMap
+{
+  typedef HFBiMapSnapshotTraits<Key> KeyTraits;
+  typedef HFBiMapSnapshotTraits<Value> ValueTraits;
+public:
+  typedef typename KeyTraits::View KeyView;
+  typedef typename ValueTraits::View ValueView;
+  class const_iterator
+  {
+    friend class HFBiMappedMap<Key,Value>;
+  protected:
+    const HFBiMappedMap<Key,Value> *m_map;
+    bool m_isForward;
+    int m_pos;
+    inline int entry() const { return m_isForward?m_pos:int(m_map->m_byValue[m_pos]); }
+  public:
+    inline const_iterator(const HFBiMappedMap<Key,Value> *map, bool isForward, int pos): m_map(map), m_isForward(isForward), m_pos(pos) { }
+
+    inline KeyView key() const { return m_map->keyAt(entry()); }
+    inline ValueView value() const { return m_map->valueAt(entry()); }
+    inline quint64 id() const { return m_map->m_ids[entry()]; }
+
+    inline bool operator!=(const const_iterator &o) const { return !(*this==o); }
+    // As with HFBiMap, end() and endValue() compare equal
+    inline bool operator==(const const_iterator &o) const { return m_pos==o.m_pos && (m_isForward==o.m_isForward || m_pos==m_map->size()); }
+
+    inline const_iterator &operator++() { m_pos++; return *this; }
+    inline const_iterator operator++(int) { const_iterator r=*this; m_pos++; return r; }
+    inline const_iterator &operator--() { m_pos--; return *this; }
+    inline const_iterator operator--(int) { const_iterator r=*this; m_pos--; return r; }
+    inline const_iterator operator+(int j) const { auto r=*this; r.m_pos+=j; return r; }
+    inline const_iterator operator-(int j) const { auto r=*this; r.m_pos-=j; return r; }
+    inline const_iterator &operator+=(int j) { m_pos+=j; return *this; }
+    inline const_iterator &operator-=(int j) { m_pos-=j; return *this; }
+  };
+  typedef const_iterator iterator;
+
+  HFBiMappedMap() { reset(); }
+  ~HFBiMappedMap() { close(); }
+
+  // Writes map to device in the snapshot format
+  template <class Storage> static inline bool save(const HFBiMap<Key, Value, Storage> &map, QIODevice *device) { return save(map.freeze(), device); }
+  static bool save(const HFBiFlatMap<Key, Value> &map, QIODevice *device)
+  {
+    const HFBiFlatMapData<Key, Value> *d=map.m_data.constData();
+    quint64 n=quint64(d->keys.size());
+    // The blob holds the text of all keys, then of all values: a first pass sizes it, since the header goes first
+    quint64 keyBlob=0, blobSize=0;
+    for(quint64 i=0;i<n;i++)
+      KeyTraits::store(d->keys.at(int(i)), keyBlob);
+    blobSize=keyBlob;
+    for(quint64 i=0;i<n;i++)
+      ValueTraits::store(d->values.at(int(i)), blobSize);
+    if(keyBlob>KeyTraits::maximumBlob() || blobSize>ValueTraits::maximumBlob())
+      return false;
+
+    HFBiMappedMapHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "HFBiMap", 8);
+    header.version=Version;
+    header.byteOrder=ByteOrder;
+    header.keySlot=sizeof(typename KeyTraits::Slot);
+    header.valueSlot=sizeof(typename ValueTraits::Slot);
+    header.count=n;
+    header.id=d->id;
+    header.keys=align(sizeof(header));
+    header.values=align(header.keys+n*sizeof(typename KeyTraits::Slot));
+    header.ids=align(header.values+n*sizeof(typename ValueTraits::Slot));
+    header.byValue=align(header.ids+n*sizeof(quint64));
+    header.blob=align(header.byValue+n*sizeof(quint32));
+    header.blobSize=blobSize;
+
+    // Sections go straight to the device, so the size of a snapshot is not bound by the one of a QByteArray
+    HFBiMappedMapWriter writer(device);
+    writer.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    writer.pad(header.keys);
+    quint64 blob=0;
+    for(quint64 i=0;i<n;i++)
+    {
+      typename KeyTraits::Slot key=KeyTraits::store(d->keys.at(int(i)), blob);
+      writer.append(reinterpret_cast<const char *>(&key), sizeof(key));
+    }
+    writer.pad(header.values);
+    for(quint64 i=0;i<n;i++)
+    {
+      typename ValueTraits::Slot value=ValueTraits::store(d->values.at(int(i)), blob);
+      writer.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+    writer.pad(header.ids);
+    writer.append(reinterpret_cast<const char *>(d->ids.constData()), n*sizeof(quint64));
+    writer.pad(header.byValue);
+    for(quint64 i=0;i<n;i++)
+    {
+      quint32 pos=quint32(d->byValue.at(int(i)));
+      writer.append(reinterpret_cast<const char *>(&pos), sizeof(pos));
+    }
+    writer.pad(header.blob);
+    for(quint64 i=0;i<n;i++)
+      KeyTraits::write(d->keys.at(int(i)), writer);
+    for(quint64 i=0;i<n;i++)
+      ValueTraits::write(d->values.at(int(i)), writer);
+    return writer.flush();
+  }
+
+  // Maps the snapshot saved in fileName, which stays open until close(). Returns false if the file is missing or not a valid snapshot.
+  // Opening scans the arrays once to validate them, without copying or parsing anything.
+  bool open(const QString &fileName)
+  {
+    close();
+    m_file.setFileName(fileName);
+    if(!m_file.open(QIODevice::ReadOnly))
+      return false;
+    qint64 size=m_file.size();
+    const uchar *data=size>0?m_file.map(0, size):nullptr;
+    if(!data || !attach(reinterpret_cast<const char *>(data), quint64(size)))
+    {
+      close();
+      return false;
+    }
+    return true;
+  }
+  // Serves the snapshot held by data (e.g. a resource), which is implicitly shared with the caller instead of mapping a file.
+  // The data must be aligned to 8 bytes, as the heap buffer of a QByteArray is.
+  bool setData(const QByteArray &data)
+  {
+    close();
+    m_buffer=data;
+    if(!attach(m_buffer.constData(), quint64(m_buffer.size())))
+    {
+      close();
+      return false;
+    }
+    return true;
+  }
+  void close()
+  {
+    m_file.close();
+    m_buffer=QByteArray();
+    reset();
+  }
+
+  inline const_iterator begin() const { return constBegin(); }
+  inline const_iterator beginValue() const { return constBeginValue(); }
+  inline const_iterator constBegin() const { return const_iterator(this, true, 0); }
+  inline const_iterator constBeginValue() const { return const_iterator(this, false, 0); }
+  inline const_iterator constEnd() const { return const_iterator(this, true, size()); }
+  inline const_iterator constEndValue() const { return const_iterator(this, false, size()); }
+  inline bool contains(const Key &key) const { return find(key)!=constEnd(); }
+  inline bool containsValue(const Value &value) const { return findValue(value)!=constEnd(); }
+  inline int count() const { return size(); }
+  inline int count(const Key &key) const { return keyUpper(key)-keyLower(key); }
+  inline int countValue(const Value &value) const { return valueUpper(value)-valueLower(value); }
+  inline const_iterator end() const { return constEnd(); }
+  inline const_iterator endValue() const { return constEndValue(); }
+  inline const_iterator find(const Key &key) const
+  {
+    int pos=keyLower(key);
+    return pos<size() && !qMapLessThanKey(key, keyAt(pos))?const_iterator(this, true, pos):constEnd();
+  }
+  inline const_iterator findValue(const Value &value) const
+  {
+    int pos=valueLower(value);
+    return pos<size() && !qMapLessThanKey(value, valueAt(int(m_byValue[pos])))?const_iterator(this, false, pos):constEnd();
+  }
+  inline bool isEmpty() const { return size()==0; }
+  inline bool isOpen() const { return m_header!=nullptr; }
+  inline const Key key(const Value &value, const Key &defaultKey = Key()) const
+  {
+    auto it=findValue(value);
+    return it!=constEnd()?KeyTraits::toObject(it.key()):defaultKey;
+  }
+  inline const_iterator lowerBound(const Key &key) const { return const_iterator(this, true, keyLower(key)); }
+  inline const_iterator lowerBoundValue(const Value &value) const { return const_iterator(this, false, valueLower(value)); }
+  inline int size() const { return m_header?int(m_header->count):0; }
+  // Copy of the snapshot in memory, keeping entry ids
+  HFBiFlatMap<Key, Value> toFlatMap() const
+  {
+    HFBiFlatMap<Key, Value> ret;
+    HFBiFlatMapData<Key, Value> *d=ret.m_data.data();
+    int n=size();
+    d->keys.reserve(n);
+    d->values.reserve(n);
+    d->ids.reserve(n);
+    d->byValue.reserve(n);
+    for(int i=0;i<n;i++)
+    {
+      d->keys.append(KeyTraits::toObject(keyAt(i)));
+      d->values.append(ValueTraits::toObject(valueAt(i)));
+      d->ids.append(m_ids[i]);
+      d->byValue.append(int(m_byValue[i]));
+    }
+    d->id=m_header?m_header->id:0;
+    d->index();
+    return ret;
+  }
+  // Mutable copy of the snapshot, see HFBiFlatMap::thaw
+  template <class Map = HFBiMap<Key, Value> > inline Map thaw(Map ret = Map()) const { return toFlatMap().template thaw<Map>(std::move(ret)); }
+  inline const_iterator upperBound(const Key &key) const { return const_iterator(this, true, keyUpper(key)); }
+  inline const_iterator upperBoundValue(const Value &value) const { return const_iterator(this, false, valueUpper(value)); }
+  inline const Value value(const Key &key, const Value &defaultValue = Value()) const
+  {
+    auto it=find(key);
+    return it!=constEnd()?ValueTraits::toObject(it.value()):defaultValue;
+  }
+protected:
+  enum { Version=1, ByteOrder=0x01020304 };
+  static inline quint64 align(quint64 offset) { return (offset+7)&~quint64(7); }
+  inline void reset()
+  {
+    m_header=nullptr;
+    m_keys=nullptr;
+    m_values=nullptr;
+    m_ids=nullptr;
+    m_byValue=nullptr;
+    m_blob=nullptr;
+  }
+  // Whether a section of count items of the given size, starting at offset, is aligned and lies within size bytes
+  static inline bool fits(quint64 offset, quint64 count, quint64 item, quint64 size)
+  {
+    return offset%8==0 && offset<=size && count<=(size-offset)/item;
+  }
+  // Checks the snapshot at data and points the sections into it. Besides the header, every slot and position is checked once,
+  // so that lookups on a truncated or corrupt file can't read outside of it
+  bool attach(const char *data, quint64 size)
+  {
+    if(size<sizeof(HFBiMappedMapHeader) || quintptr(data)%8)
+      return false;
+    const HFBiMappedMapHeader *header=reinterpret_cast<const HFBiMappedMapHeader *>(data);
+    if(memcmp(header->magic, "HFBiMap", 8) || header->version!=Version || header->byteOrder!=ByteOrder ||
+       header->keySlot!=sizeof(typename KeyTraits::Slot) || header->valueSlot!=sizeof(typename ValueTraits::Slot))
+      return false;
+    quint64 n=header->count;
+    if(n>quint64(std::numeric_limits<int>::max()) || !fits(header->blob, header->blobSize, 1, size) ||
+       !fits(header->keys, n, header->keySlot, size) || !fits(header->values, n, header->valueSlot, size) ||
+       !fits(header->ids, n, sizeof(quint64), size) || !fits(header->byValue, n, sizeof(quint32), size))
+      return false;
+    const typename KeyTraits::Slot *keys=reinterpret_cast<const typename KeyTraits::Slot *>(data+header->keys);
+    const typename ValueTraits::Slot *values=reinterpret_cast<const typename ValueTraits::Slot *>(data+header->values);
+    const quint32 *byValue=reinterpret_cast<const quint32 *>(data+header->byValue);
+    for(quint64 i=0;i<n;i++)
+    {
+      if(!KeyTraits::valid(keys[i], header->blobSize) || !ValueTraits::valid(values[i], header->blobSize) || byValue[i]>=n)
+        return false;
+    }
+    m_header=header;
+    m_keys=keys;
+    m_values=values;
+    m_ids=reinterpret_cast<const quint64 *>(data+header->ids);
+    m_byValue=byValue;
+    m_blob=data+header->blob;
+    return true;
+  }
+  inline KeyView keyAt(int i) const { return KeyTraits::view(m_keys[i], m_blob); }
+  inline ValueView valueAt(int i) const { return ValueTraits::view(m_values[i], m_blob); }
+  inline int keyLower(const Key &key) const
+  {
+    int first=0, count=size();
+    while(count>0)
+    {
+      int step=count/2;
+      if(qMapLessThanKey(keyAt(first+step), key)) { first+=step+1; count-=step+1; }
+      else count=step;
+    }
+    return first;
+  }
+  inline int keyUpper(const Key &key) const
+  {
+    int first=0, count=size();
+    while(count>0)
+    {
+      int step=count/2;
+      if(!qMapLessThanKey(key, keyAt(first+step))) { first+=step+1; count-=step+1; }
+      else count=step;
+    }
+    return first;
+  }
+  inline int valueLower(const Value &value) const
+  {
+    int first=0, count=size();
+    while(count>0)
+    {
+      int step=count/2;
+      if(qMapLessThanKey(valueAt(int(m_byValue[first+step])), value)) { first+=step+1; count-=step+1; }
+      else count=step;
+    }
+    return first;
+  }
+  inline int valueUpper(const Value &value) const
+  {
+    int first=0, count=size();
+    while(count>0)
+    {
+      int step=count/2;
+      if(!qMapLessThanKey(value, valueAt(int(m_byValue[first+step])))) { first+=step+1; count-=step+1; }
+      else count=step;
+    }
+    return first;
+  }
+
+  QFile m_file;
+  QByteArray m_buffer;
+  const HFBiMappedMapHeader *m_header;
+  const typename KeyTraits::Slot *m_keys;
+  const typename ValueTraits::Slot *m_values;
+  const quint64 *m_ids;
+  const quint32 *m_byValue;
+  const char *m_blob;
+private:
+  HFBiMappedMap(const HFBiMappedMap<Key, Value> &) = delete;
+  HFBiMappedMap<Key, Value> &operator=(const HFBiMappedMap<Key, Value> &) = delete;
+};
+
+#endif // HFBiMappedMap_Header
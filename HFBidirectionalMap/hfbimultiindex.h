@@ -0,0 +1,190 @@
+/*
+ * Copyright 2021 Marzocchi Alessandro
+ * All rights reserved. Distributed under the terms of the MIT license.
+ */
+
+#ifndef HFBiMultiIndex_Header
+#define HFBiMultiIndex_Header
+
+#include <QMap>
+#include <QSharedDataPointer>
+#include <initializer_list>
+#include <tuple>
+#include <hfbimap.h>
+
+// Applies an operation to the indexes from I down to 0
+template <int I, class... Columns> struct HFBiMultiIndexEach
+{
+  typedef std::tuple<Columns...> Record;
+  typedef std::tuple<QMap<HFBiMapFirst<Columns>, Record *>...> Indexes;
+  static inline void link(Indexes &indexes, Record *record, quint64 id)
+  {
+    std::get<I>(indexes).insertMulti({&std::get<I>(*record), id}, record);
+    HFBiMultiIndexEach<I-1, Columns...>::link(indexes, record, id);
+  }
+  static inline void unlink(Indexes &indexes, Record *record, quint64 id)
+  {
+    std::get<I>(indexes).remove({&std::get<I>(*record), id});
+    HFBiMultiIndexEach<I-1, Columns...>::unlink(indexes, record, id);
+  }
+  static inline void clear(Indexes &indexes)
+  {
+    std::get<I>(indexes).clear();
+    HFBiMultiIndexEach<I-1, Columns...>::clear(indexes);
+  }
+};
+template <class... Columns> struct HFBiMultiIndexEach<-1, Columns...>
+{
+  typedef std::tuple<Columns...> Record;
+  typedef std::tuple<QMap<HFBiMapFirst<Columns>, Record *>...> Indexes;
+  static inline void link(Indexes &, Record *, quint64) { }
+  static inline void unlink(Indexes &, Record *, quint64) { }
+  static inline void clear(Indexes &) { }
+};
+
+template <class... Columns> struct HFBiMultiIndexData: public QSharedData
+{
+  typedef std::tuple<Columns...> Record;
+  typedef HFBiMultiIndexEach<sizeof...(Columns)-1, Columns...> Each;
+  HFBiMultiIndexData(): id(0) { }
+  HFBiMultiIndexData(const HFBiMultiIndexData<Columns...> &base): id(base.id)
+  {
+    auto &first=std::get<0>(base.indexes);
+    for(auto it=first.constBegin();it!=first.constEnd();++it)
+      link(new Record(*it.value()), it.key().id);
+  }
+  ~HFBiMultiIndexData() { clear(); }
+  // Every record appears once in each index, all the entries for a record sharing the same id
+  std::tuple<QMap<HFBiMapFirst<Columns>, Record *>...> indexes;
+  quint64 id;
+  void clear()
+  {
+    auto &first=std::get<0>(indexes);
+    for(auto it=first.constBegin();it!=first.constEnd();++it)
+      delete it.value();
+    Each::clear(indexes);
+  }
+  inline void link(Record *record, quint64 id) { Each::link(indexes, record, id); }
+  inline void unlink(Record *record, quint64 id)
+  {
+    Each::unlink(indexes, record, id);
+    delete record;
+  }
+};
+
+/** Container of records with several columns, each one with an ordered index of its own: a generalization of HFBiMultiMap to any number
+ * of columns. Every record is stored once and it can be found, iterated and erased through any of the indexes, which are selected
+ * by column number (e.g. find<1>(name)). As in HFBiMap, records with the same value in a column are ordered from the latest inserted.
+ * Records can't be modified in place, as that would break the indexes; erase and insert them again instead.
+ */
+template <class... Columns> class HFBiMultiIndex
+{
+  static_assert(sizeof...(Columns)>0, "HFBiMultiIndex needs at least one column");
+public:
+  typedef std::tuple<Columns...> Record;
+  template <int I> using Column = typename std::tuple_element<I, Record>::type;
+
+  // Iterates the records in the order of column I
+  template <int I> class const_iterator
+  {
+    friend class HFBiMultiIndex<Columns...>;
+    typedef typename QMap<HFBiMapFirst<Column<I> >, Record *>::const_iterator Base;
+  public:
+    inline const_iterator() { }
+    inline const Column<I> &key() const { return *m_it.key().d; }
+    template <int J> inline const Column<J> &column() const { return std::get<J>(*m_it.value()); }
+    inline const Record &record() const { return *m_it.value(); }
+    inline quint64 id() const { return m_it.key().id; }
+    inline const Record &operator*() const { return record(); }
+    inline const Record *operator->() const { return m_it.value(); }
+
+    inline bool operator==(const const_iterator<I> &o) const { return m_it==o.m_it; }
+    inline bool operator!=(const const_iterator<I> &o) const { return m_it!=o.m_it; }
+    inline const_iterator<I> &operator++() { ++m_it; return *this; }
+    inline const_iterator<I> operator++(int) { const_iterator<I> r=*this; ++m_it; return r; }
+    inline const_iterator<I> &operator--() { --m_it; return *this; }
+    inline const_iterator<I> operator--(int) { const_iterator<I> r=*this; --m_it; return r; }
+  private:
+    inline explicit const_iterator(Base it): m_it(it) { }
+    Base m_it;
+  };
+
+  inline HFBiMultiIndex(): m_data(new HFBiMultiIndexData<Columns...>()) { }
+  inline HFBiMultiIndex(std::initializer_list<Record> init): HFBiMultiIndex()
+  {
+    for(auto it=init.begin();it!=init.end();++it)
+      insert(*it);
+  }
+
+  template <int I> inline const_iterator<I> begin() const { return const_iterator<I>(std::get<I>(m_data->indexes).constBegin()); }
+  inline void clear() { m_data->clear(); }
+  template <int I> inline bool contains(const Column<I> &key) const { return find<I>(key)!=end<I>(); }
+  inline int count() const { return size(); }
+  template <int I> inline int count(const Column<I> &key) const
+  {
+    int ret=0;
+    for(auto it=lowerBound<I>(key);it!=end<I>() && !qMapLessThanKey(key, it.key());++it, ++ret) { }
+    return ret;
+  }
+  inline bool empty() const { return isEmpty(); }
+  template <int I> inline const_iterator<I> end() const { return const_iterator<I>(std::get<I>(m_data->indexes).constEnd()); }
+  // Removes the record from all the indexes, returning the iterator to the next one in column I
+  template <int I> const_iterator<I> erase(const_iterator<I> pos)
+  {
+    auto &index=std::get<I>(m_data->indexes);
+    // pos may refer to the data before it was detached, but ids survive the copy
+    auto it=index.find(pos.m_it.key());
+    if(it==index.end())
+      return end<I>();
+    Record *record=it.value();
+    quint64 id=it.key().id;
+    ++it;
+    m_data->unlink(record, id);
+    return const_iterator<I>(it);
+  }
+  // Latest inserted record having key in column I
+  template <int I> inline const_iterator<I> find(const Column<I> &key) const
+  {
+    auto &index=std::get<I>(m_data->indexes);
+    auto it=index.lowerBound({&key, std::numeric_limits<quint64>::max()-1});
+    return const_iterator<I>(it!=index.constEnd() && !qMapLessThanKey(key, *it.key().d)?it:index.constEnd());
+  }
+  // Records can share values in any column
+  inline void insert(const Columns&... columns) { insert(Record(columns...)); }
+  inline void insert(const Record &record) { m_data->link(new Record(record), ++m_data->id); }
+  inline void insert(Record &&record) { m_data->link(new Record(std::move(record)), ++m_data->id); }
+  inline bool isEmpty() const { return std::get<0>(m_data->indexes).isEmpty(); }
+  template <int I> inline const_iterator<I> lowerBound(const Column<I> &key) const { return const_iterator<I>(std::get<I>(m_data->indexes).lowerBound({&key, std::numeric_limits<quint64>::max()-1})); }
+  // Erases all the records having key in column I
+  template <int I> int remove(const Column<I> &key)
+  {
+    auto &index=std::get<I>(m_data->indexes);
+    int ret=0;
+    auto it=index.lowerBound({&key, std::numeric_limits<quint64>::max()-1});
+    while(it!=index.end() && !qMapLessThanKey(key, *it.key().d))
+    {
+      Record *record=it.value();
+      quint64 id=it.key().id;
+      ++it;
+      m_data->unlink(record, id);
+      ret++;
+    }
+    return ret;
+  }
+  inline int size() const { return std::get<0>(m_data->indexes).size(); }
+  inline void swap(HFBiMultiIndex<Columns...> &other) { m_data.swap(other.m_data); }
+  template <int I> inline const_iterator<I> upperBound(const Column<I> &key) const { return const_iterator<I>(std::get<I>(m_data->indexes).upperBound({&key, 0})); }
+  // Values of column I, in its order
+  template <int I> inline QList<Column<I> > values() const
+  {
+    QList<Column<I> > ret;
+    ret.reserve(size());
+    for(auto it=begin<I>();it!=end<I>();++it)
+      ret.append(it.key());
+    return ret;
+  }
+protected:
+  QSharedDataPointer<HFBiMultiIndexData<Columns...> > m_data;
+};
+
+#endif // HFBiMultiIndex_Header
@@ -0,0 +1,539 @@
+/*
+ * Copyright 2021 Marzocchi Alessandro
+ * All rights reserved. Distributed under the terms of the MIT license.
+ */
+
+#ifndef HFBiPersistentMap_Header
+#define HFBiPersistentMap_Header
+
+#include <QAtomicInt>
+#include <QList>
+#include <algorithm>
+#include <type_traits>
+#include <hfbimap.h>
+
+// Key and value of an entry, shared by the nodes of both trees and by all the copies of the map referring to it
+template <class Key, class Value> struct HFBiPersistentEntry
+{
+  template <class K, class... Args> HFBiPersistentEntry(quint64 id, K &&key, Args&&... args): ref(0), key(std::forward<K>(key)), value(std::forward<Args>(args)...), id(id) { }
+  QAtomicInt ref;
+  const Key key;
+  const Value value;
+  const quint64 id;
+};
+
+template <class Key, class Value> struct HFBiPersistentNode
+{
+  typedef HFBiPersistentEntry<Key, Value> Entry;
+  HFBiPersistentNode(Entry *entry): ref(1), left(nullptr), right(nullptr), entry(entry), height(1), size(1) { entry->ref.ref(); }
+  // Path copy: the copy shares children and entry with the original
+  HFBiPersistentNode(const HFBiPersistentNode<Key, Value> &other): ref(1), left(other.left), right(other.right), entry(other.entry), height(other.height), size(other.size)
+  {
+    if(left) left->ref.ref();
+    if(right) right->ref.ref();
+    entry->ref.ref();
+  }
+  QAtomicInt ref;
+  HFBiPersistentNode<Key, Value> *left, *right;
+  Entry *entry;
+  int height;
+  int size; // Nodes in the subtree, for the searches by position
+
+  static void release(HFBiPersistentNode<Key, Value> *node)
+  {
+    if(node && !node->ref.deref())
+    {
+      release(node->left);
+      release(node->right);
+      releaseEntry(node->entry);
+      delete node;
+    }
+  }
+  static inline void releaseEntry(Entry *entry)
+  {
+    if(!entry->ref.deref())
+      delete entry;
+  }
+};
+
+/** Immutable AVL tree of HFBiPersistentNode sorted like the forward (Forward=true) or reverse index of HFBiMap.
+ * Modifying functions take the reference held on a root and give back the reference to the new root: nodes owned only by the caller
+ * are modified in place, shared ones are copied, so every other tree sharing them is left untouched.
+ */
+template <class Key, class Value, bool Forward> struct HFBiPersistentTree
+{
+  typedef HFBiPersistentEntry<Key, Value> Entry;
+  typedef HFBiPersistentNode<Key, Value> Node;
+  typedef typename std::conditional<Forward, Key, Value>::type T;
+
+  static inline const Key &field(const Entry *entry, std::true_type) { return entry->key; }
+  static inline const Value &field(const Entry *entry, std::false_type) { return entry->value; }
+  static inline const T &field(const Entry *entry) { return field(entry, std::integral_constant<bool, Forward>()); }
+  // Same ordering as qMapLessThanKey on HFBiMapFirst
+  static inline bool less(const Entry *a, const Entry *b)
+  {
+    return qMapLessThanKey(field(a), field(b)) || (!qMapLessThanKey(field(b), field(a)) && a->id>b->id);
+  }
+  static inline int height(const Node *node) { return node?node->height:0; }
+  static inline int size(const Node *node) { return node?node->size:0; }
+
+  // Fills path with the nodes to visit to iterate from the first element of the tree
+  static int first(const Node *node, const Node **path)
+  {
+    int depth=0;
+    for(;node;node=node->left)
+      path[depth++]=node;
+    return depth;
+  }
+  // As first, from the first element not less than t
+  static int lowerBound(const Node *node, const T &t, const Node **path)
+  {
+    int depth=0;
+    while(node)
+    {
+      if(!qMapLessThanKey(field(node->entry), t)) { path[depth++]=node; node=node->left; }
+      else node=node->right;
+    }
+    return depth;
+  }
+  // As lowerBound, from the first element greater than t
+  static int upperBound(const Node *node, const T &t, const Node **path)
+  {
+    int depth=0;
+    while(node)
+    {
+      if(qMapLessThanKey(t, field(node->entry))) { path[depth++]=node; node=node->left; }
+      else node=node->right;
+    }
+    return depth;
+  }
+  // As lowerBound, from the first element following entry (included if inclusive is set)
+  static int seek(const Node *node, const Entry *entry, bool inclusive, const Node **path)
+  {
+    int depth=0;
+    while(node)
+    {
+      if(less(entry, node->entry) || (inclusive && node->entry==entry)) { path[depth++]=node; node=node->left; }
+      else node=node->right;
+    }
+    return depth;
+  }
+  // Last element preceding entry, or the last element of the tree if entry is null
+  static const Entry *predecessor(const Node *node, const Entry *entry)
+  {
+    const Entry *ret=nullptr;
+    while(node)
+    {
+      if(!entry || less(node->entry, entry)) { ret=node->entry; node=node->right; }
+      else node=node->left;
+    }
+    return ret;
+  }
+  // As first, from the element at position i (none if i is out of range)
+  static int select(const Node *node, int i, const Node **path)
+  {
+    int depth=0;
+    if(i<0)
+      return 0;
+    while(node)
+    {
+      int left=size(node->left);
+      if(i<=left)
+      {
+        path[depth++]=node;
+        if(i==left)
+          return depth;
+        node=node->left;
+      }
+      else
+      {
+        i-=left+1;
+        node=node->right;
+      }
+    }
+    return 0;
+  }
+  // Number of elements less than t
+  static int rank(const Node *node, const T &t)
+  {
+    int ret=0;
+    while(node)
+    {
+      if(qMapLessThanKey(field(node->entry), t)) { ret+=size(node->left)+1; node=node->right; }
+      else node=node->left;
+    }
+    return ret;
+  }
+  // Position of entry, which must be in the tree
+  static int rankOf(const Node *node, const Entry *entry)
+  {
+    int ret=0;
+    while(node)
+    {
+      if(node->entry==entry)
+        return ret+size(node->left);
+      if(less(entry, node->entry))
+        node=node->left;
+      else
+      {
+        ret+=size(node->left)+1;
+        node=node->right;
+      }
+    }
+    return ret;
+  }
+  static Entry *find(const Node *node, const T &t)
+  {
+    const Node *path[MaxDepth];
+    int depth=lowerBound(node, t, path);
+    return depth && !qMapLessThanKey(t, field(path[depth-1]->entry))?path[depth-1]->entry:nullptr;
+  }
+
+  static Node *insert(Node *node, Entry *entry)
+  {
+    if(!node)
+      return new Node(entry);
+    node=own(node);
+    if(less(entry, node->entry))
+      node->left=insert(node->left, entry);
+    else
+      node->right=insert(node->right, entry);
+    return balance(node);
+  }
+  // entry must be in the tree
+  static Node *erase(Node *node, const Entry *entry)
+  {
+    node=own(node);
+    if(less(entry, node->entry))
+      node->left=erase(node->left, entry);
+    else if(node->entry!=entry)
+      node->right=erase(node->right, entry);
+    else
+    {
+      if(!node->left || !node->right)
+      {
+        Node *child=node->left?node->left:node->right;
+        node->left=node->right=nullptr;
+        Node::release(node);
+        return child;
+      }
+      // Take the place of the successor, which is then removed from the right subtree
+      const Node *next=node->right;
+      while(next->left)
+        next=next->left;
+      Entry *old=node->entry;
+      node->entry=next->entry;
+      node->entry->ref.ref();
+      node->right=erase(node->right, node->entry);
+      Node::releaseEntry(old);
+    }
+    return balance(node);
+  }
+
+  // Node that can be modified in place by the holder of the reference
+  static inline Node *own(Node *node)
+  {
+    if(node->ref.loadAcquire()==1)
+      return node;
+    Node *copy=new Node(*node);
+    Node::release(node);
+    return copy;
+  }
+  static inline void update(Node *node)
+  {
+    node->height=1+std::max(height(node->left), height(node->right));
+    node->size=1+size(node->left)+size(node->right);
+  }
+  static inline Node *rotateRight(Node *node)
+  {
+    Node *left=own(node->left);
+    node->left=left->right;
+    left->right=node;
+    update(node);
+    update(left);
+    return left;
+  }
+  static inline Node *rotateLeft(Node *node)
+  {
+    Node *right=own(node->right);
+    node->right=right->left;
+    right->left=node;
+    update(node);
+    update(right);
+    return right;
+  }
+  static Node *balance(Node *node)
+  {
+    update(node);
+    int diff=height(node->left)-height(node->right);
+    if(diff>1)
+    {
+      if(height(node->left->left)<height(node->left->right))
+        node->left=rotateLeft(own(node->left));
+      return rotateRight(node);
+    }
+    if(diff<-1)
+    {
+      if(height(node->right->right)<height(node->right->left))
+        node->right=rotateRight(own(node->right));
+      return rotateLeft(node);
+    }
+    return node;
+  }
+  // Enough for any AVL tree addressable with an int
+  enum { MaxDepth=48 };
+};
+
+/** This class provides the functions of HFBiMap on top of a pair of persistent trees.
+ * Copying the map is O(1) and the copy shares all the nodes with the original: a following modification of either one copies only
+ * the O(log n) nodes on the path it touches, instead of detaching the whole map as HFBiMap does.
+ * Copies can be handed to other threads while the original keeps being modified.
+ * The nodes know the size of their subtree, so rank, at and moving an iterator by an offset are O(log n) too.
+ */
+template <class Key, class Value> class HFBiPersistentMap
+{
+  typedef HFBiPersistentEntry<Key, Value> Entry;
+  typedef HFBiPersistentNode<Key, Value> Node;
+  typedef HFBiPersistentTree<Key, Value, true> ForwardTree;
+  typedef HFBiPersistentTree<Key, Value, false> ReverseTree;
+public:
+  class const_iterator
+  {
+    friend class HFBiPersistentMap<Key,Value>;
+  protected:
+    bool m_isForward;
+    const Node *m_root;
+    // Current node on top, preceded by the ancestors it lies on the left of
+    const Node *m_path[ForwardTree::MaxDepth];
+    int m_depth;
+    inline const Entry *entry() const { return m_path[m_depth-1]->entry; }
+    inline void seek(const Entry *entry) { m_depth=entry?(m_isForward?ForwardTree::seek(m_root, entry, true, m_path):ReverseTree::seek(m_root, entry, true, m_path)):0; }
+    inline void select(int i) { m_depth=m_isForward?ForwardTree::select(m_root, i, m_path):ReverseTree::select(m_root, i, m_path); }
+    // Position in the order of the iterator, the size of the map for end()
+    inline int rank() const
+    {
+      if(!m_depth)
+        return ForwardTree::size(m_root);
+      return m_isForward?ForwardTree::rankOf(m_root, entry()):ReverseTree::rankOf(m_root, entry());
+    }
+  public:
+    inline const_iterator(bool isForward, const Node *root): m_isForward(isForward), m_root(root), m_depth(0) { }
+
+    inline const Key &key() const { return entry()->key; }
+    inline const Value &value() const { return entry()->value; }
+    inline qint64 id() const { return entry()->id; }
+
+    inline bool operator!=(const const_iterator &o) const {
+      return !(*this==o);
+    }
+    // As with HFBiMap, end() and endValue() compare equal
+    inline bool operator==(const const_iterator &o) const {
+      if(!m_depth || !o.m_depth)
+        return m_depth==o.m_depth;
+      return m_isForward==o.m_isForward && m_path[m_depth-1]==o.m_path[o.m_depth-1];
+    }
+
+    inline const_iterator &operator++()
+    {
+      const Node *node=m_path[--m_depth]->right;
+      for(;node;node=node->left)
+        m_path[m_depth++]=node;
+      return *this;
+    }
+    inline const_iterator operator++(int) { const_iterator r=*this; ++*this; return r; }
+    // Going backward searches the previous element from the root
+    inline const_iterator &operator--()
+    {
+      const Entry *current=m_depth?entry():nullptr;
+      seek(m_isForward?ForwardTree::predecessor(m_root, current):ReverseTree::predecessor(m_root, current));
+      return *this;
+    }
+    inline const_iterator operator--(int) { const_iterator r=*this; --*this; return r; }
+    inline const_iterator operator+(int j) const { auto r=*this; r+=j; return r; }
+    inline const_iterator operator-(int j) const { auto r=*this; r-=j; return r; }
+    // Moving out of the map gives end()
+    inline const_iterator &operator+=(int j) { if(j) select(rank()+j); return *this; }
+    inline const_iterator &operator-=(int j) { if(j) select(rank()-j); return *this; }
+  };
+  // Entries can't be modified through iterators, so all of them are constant
+  typedef const_iterator iterator;
+
+  HFBiPersistentMap(): m_forward(nullptr), m_reverse(nullptr), m_size(0), m_id(0) { }
+  HFBiPersistentMap(const HFBiPersistentMap<Key, Value> &other): m_forward(other.m_forward), m_reverse(other.m_reverse), m_size(other.m_size), m_id(other.m_id)
+  {
+    if(m_forward) m_forward->ref.ref();
+    if(m_reverse) m_reverse->ref.ref();
+  }
+  HFBiPersistentMap(HFBiPersistentMap<Key, Value> &&other): HFBiPersistentMap() { swap(other); }
+  inline HFBiPersistentMap(std::initializer_list<std::pair<Key,Value> > list): HFBiPersistentMap()
+  {
+    for (typename std::initializer_list<std::pair<Key,Value> >::const_iterator it = list.begin(); it != list.end(); ++it)
+      insert(it->first, it->second);
+  }
+  ~HFBiPersistentMap() { clear(); }
+  HFBiPersistentMap<Key, Value> &operator=(HFBiPersistentMap<Key, Value> &&other) { swap(other); return *this; }
+  HFBiPersistentMap<Key, Value> &operator=(const HFBiPersistentMap<Key, Value> &other) { HFBiPersistentMap<Key, Value> copy(other); swap(copy); return *this; }
+
+  // Entry at position i in the order of keys, end() if there is none
+  inline const_iterator at(int i) const { auto it=const_iterator(true, m_forward); it.select(i); return it; }
+  // Entry at position i in the order of values
+  inline const_iterator atValue(int i) const { auto it=const_iterator(false, m_reverse); it.select(i); return it; }
+  inline const_iterator begin() const { return constBegin(); }
+  inline const_iterator cbegin() const { return constBegin(); }
+  inline const_iterator beginValue() const { return constBeginValue(); }
+  inline const_iterator cbeginValue() const { return constBeginValue(); }
+  inline void clear()
+  {
+    Node::release(m_forward);
+    Node::release(m_reverse);
+    m_forward=m_reverse=nullptr;
+    m_size=0;
+  }
+  inline bool contains(const Key &key) const { return ForwardTree::find(m_forward, key); }
+  inline bool containsValue(const Value &value) const { return ReverseTree::find(m_reverse, value); }
+  inline const_iterator constBegin() const { auto it=const_iterator(true, m_forward); it.m_depth=ForwardTree::first(m_forward, it.m_path); return it; }
+  inline const_iterator constBeginValue() const { auto it=const_iterator(false, m_reverse); it.m_depth=ReverseTree::first(m_reverse, it.m_path); return it; }
+  inline const_iterator constEnd() const { return const_iterator(true, m_forward); }
+  inline const_iterator constEndValue() const { return const_iterator(false, m_reverse); }
+  inline int count() const { return m_size; }
+  inline bool empty() const { return isEmpty(); }
+  inline const_iterator end() const { return constEnd(); }
+  inline const_iterator cend() const { return constEnd(); }
+  inline const_iterator endValue() const { return constEndValue(); }
+  inline const_iterator cendValue() const { return constEndValue(); }
+  // Returns the iterator following pos in the same direction
+  const_iterator erase(const_iterator pos)
+  {
+    if(!pos.m_depth)
+      return pos;
+    Entry *entry=pos.m_path[pos.m_depth-1]->entry;
+    entry->ref.ref();
+    unlink(entry);
+    auto ret=const_iterator(pos.m_isForward, pos.m_isForward?m_forward:m_reverse);
+    ret.m_depth=pos.m_isForward?ForwardTree::seek(m_forward, entry, false, ret.m_path):ReverseTree::seek(m_reverse, entry, false, ret.m_path);
+    Node::releaseEntry(entry);
+    return ret;
+  }
+  inline const_iterator find(const Key &key) const { return findConst(key); }
+  inline const_iterator findConst(const Key &key) const
+  {
+    auto it=lowerBound(key);
+    return it.m_depth && !qMapLessThanKey(key, it.key())?it:constEnd();
+  }
+  inline const_iterator findValue(const Value &value) const { return findValueConst(value); }
+  inline const_iterator findValueConst(const Value &value) const
+  {
+    auto it=lowerBoundValue(value);
+    return it.m_depth && !qMapLessThanKey(value, it.value())?it:constEnd();
+  }
+  inline const Key &firstKey() const { return constBegin().key(); }
+  inline const Value &firstValue() const { return constBeginValue().value(); }
+  inline void insert(const Key &key, const Value &value)
+  {
+    remove(key);
+    removeValue(value);
+    insertMulti(key, value);
+  }
+  // Allows multiple entries with same key to exist, but not multiple values
+  inline void insertMultiKey(const Key &key, const Value &value)
+  {
+    removeValue(value);
+    insertMulti(key, value);
+  }
+  // Allows multiple entries with same value to exist, but not multiple keys
+  inline void insertMultiValue(const Key &key, const Value &value)
+  {
+    remove(key);
+    insertMulti(key, value);
+  }
+  inline void insertMulti(const Key &key, const Value &value)
+  {
+    Entry *entry=new Entry(++m_id, key, value);
+    m_forward=ForwardTree::insert(m_forward, entry);
+    m_reverse=ReverseTree::insert(m_reverse, entry);
+    m_size++;
+  }
+  inline bool isEmpty() const { return !m_size; }
+  inline const Key key(const Value &value, const Key &defaultKey = Key()) const
+  {
+    const Entry *entry=ReverseTree::find(m_reverse, value);
+    return entry?entry->key:defaultKey;
+  }
+  inline QList<Key> keys() const { QList<Key> ret; for(auto it=constBegin();it!=constEnd();++it) { ret.append(it.key()); } return ret; }
+  inline const Key &last() const { return ForwardTree::predecessor(m_forward, nullptr)->key; }
+  inline const Value &lastValue() const { return ReverseTree::predecessor(m_reverse, nullptr)->value; }
+  inline const_iterator lowerBound(const Key &key) const { auto it=const_iterator(true, m_forward); it.m_depth=ForwardTree::lowerBound(m_forward, key, it.m_path); return it; }
+  inline const_iterator lowerBoundValue(const Value &value) const { auto it=const_iterator(false, m_reverse); it.m_depth=ReverseTree::lowerBound(m_reverse, value, it.m_path); return it; }
+  // Number of entries whose key is less than key, i.e. the position of lowerBound(key)
+  inline int rank(const Key &key) const { return ForwardTree::rank(m_forward, key); }
+  inline int rankValue(const Value &value) const { return ReverseTree::rank(m_reverse, value); }
+  inline int remove(const Key &key) {
+    int ret=0;
+    for(Entry *entry;(entry=ForwardTree::find(m_forward, key));ret++)
+      unlink(entry);
+    return ret;
+  }
+  inline int removeValue(const Value &value) {
+    int ret=0;
+    for(Entry *entry;(entry=ReverseTree::find(m_reverse, value));ret++)
+      unlink(entry);
+    return ret;
+  }
+  inline int size() const { return m_size; }
+  inline void swap(HFBiPersistentMap<Key, Value> &other)
+  {
+    std::swap(m_forward, other.m_forward);
+    std::swap(m_reverse, other.m_reverse);
+    std::swap(m_size, other.m_size);
+    std::swap(m_id, other.m_id);
+  }
+  Value take(const Key &key, const Value &defaultValue=Value())
+  {
+    auto it=find(key);
+    if(it!=end()) { auto ret=it.value(); erase(it); return ret;}
+    return defaultValue;
+  }
+  Key takeValue(const Value &value, const Key &defaultKey=Key())
+  {
+    auto it=findValue(value);
+    if(it!=end()) { auto ret=it.key(); erase(it); return ret;}
+    return defaultKey;
+  }
+  inline const_iterator upperBound(const Key &key) const { auto it=const_iterator(true, m_forward); it.m_depth=ForwardTree::upperBound(m_forward, key, it.m_path); return it; }
+  inline const_iterator upperBoundValue(const Value &value) const { auto it=const_iterator(false, m_reverse); it.m_depth=ReverseTree::upperBound(m_reverse, value, it.m_path); return it; }
+  inline const Value value(const Key &key, const Value &defaultValue = Value()) const
+  {
+    const Entry *entry=ForwardTree::find(m_forward, key);
+    return entry?entry->value:defaultValue;
+  }
+  inline QList<Value> values() const { QList<Value> ret; for(auto it=constBeginValue();it!=constEndValue();++it) { ret.append(it.value()); } return ret; }
+  inline bool operator==(const HFBiPersistentMap<Key, Value> &other) const {
+    if(m_forward==other.m_forward) // Easy case
+      return true;
+    if(m_size!=other.m_size)
+      return false;
+    for(auto it=constBegin(), it2=other.constBegin();it!=constEnd();++it, ++it2)
+    {
+      if(it.key()!=it2.key() || it.value()!=it2.value())
+        return false;
+    }
+    return true;
+  }
+  inline bool operator!=(const HFBiPersistentMap<Key, Value> &other) const { return !(*this==other); }
+protected:
+  Node *m_forward, *m_reverse;
+  int m_size;
+  quint64 m_id;
+
+  // Removes entry from both trees, copying only the nodes shared with other maps along the way
+  inline void unlink(Entry *entry)
+  {
+    entry->ref.ref(); // Keeps it alive until both trees are done comparing with it
+    m_forward=ForwardTree::erase(m_forward, entry);
+    m_reverse=ReverseTree::erase(m_reverse, entry);
+    Node::releaseEntry(entry);
+    m_size--;
+  }
+};
+
+#endif // HFBiPersistentMap_Header
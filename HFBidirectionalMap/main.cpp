@@ -3,15 +3,71 @@
  * All rights reserved. Distributed under the terms of the MIT license.
  */
 
+#include <QBuffer>
 #include <QCoreApplication>
 #include <hfbimap.h>
+#include <hfbihash.h>
+#include <hfbiflatmap.h>
+#include <hfbipersistentmap.h>
+#include <hfbiconcurrentmap.h>
+#include <hfbimultiindex.h>
+#include <hfbimappedmap.h>
+#include <hfbidensemap.h>
 #include <QDebug>
 void testBiMap();
 void testBiMapEx();
+void testHash();
+void testPool();
+void testMoveInsert();
+void testBuild();
+void testFlatMap();
+void testPersistentMap();
+void testConcurrentMap();
+void testHeterogeneous();
+void testIntern();
+void testFindMany();
+void testMultiIndex();
+void testMappedMap();
+void testStats();
+void testArena();
+void testPrefix();
+void testRank();
+void testRemove();
+void testCount();
+void testSetAlgebra();
+void testJournal();
+void testCache();
+void testParallelBuild();
+void testFlatIndex();
+void testDenseMap();
 int main(int argc, char *argv[])
 {
   testBiMapEx();
 //  testBiMap();
+  testHash();
+  testPool();
+  testMoveInsert();
+  testBuild();
+  testFlatMap();
+  testPersistentMap();
+  testConcurrentMap();
+  testHeterogeneous();
+  testIntern();
+  testFindMany();
+  testMultiIndex();
+  testMappedMap();
+  testStats();
+  testArena();
+  testPrefix();
+  testRank();
+  testRemove();
+  testCount();
+  testSetAlgebra();
+  testJournal();
+  testCache();
+  testParallelBuild();
+  testFlatIndex();
+  testDenseMap();
 }
 struct TestData
 {
@@ -224,6 +280,440 @@ void testBiMapEx()
 //    printMap(map2);
 //  }
 
+}
+void testHash()
+{
+  qDebug()<<"Hash";
+  HFBiHash<int, QString> hash({{4,"Boo"}, {5,"Hello"}, {4,"Hello"}});
+  qDebug()<<hash.size()<<hash.value(4)<<hash.key("Hello")<<"Expected 1 Hello 4";
+  HFBiMultiHash<int, QString> multi({{4,"Boo"}, {5,"Hello"}, {4,"Hello"}, {4,"Boo"}});
+  qDebug()<<multi.count(4)<<multi.countValue("Hello")<<multi.contains(4, "Hello")<<"Expected 3 2 true";
+  auto multi2=multi;
+  qDebug()<<multi2.remove(4, "Boo")<<multi2.size()<<multi.size()<<"Expected 2 2 4";
+  qDebug()<<multi2.remove(5)<<multi2.contains(5)<<multi2.removeValue("Hello")<<multi2.isEmpty()<<"Expected 1 false 1 true";
+  auto it=multi.findValue("Hello");
+  it=multi.erase(it);
+  qDebug()<<multi.size()<<multi.countValue("Hello")<<"Expected 3 1";
+  for(it=multi.begin();it!=multi.end();)
+    it=multi.erase(it);
+  qDebug()<<multi.isEmpty()<<"Expected true";
+}
+void testPool()
+{
+  qDebug()<<"Pool storage";
+  HFBiPooledMultiMap<int, QString> pooled;
+  for(int i=0;i<1000;i++)
+    pooled.insert(i%10, QString::number(i));
+  pooled.remove(3);
+  // Freed blocks are reused, and a copy gets a pool of its own
+  for(int i=0;i<100;i++)
+    pooled.insert(3, QString::number(-i));
+  HFBiPooledMultiMap<int, QString> copy(pooled);
+  copy.removeValue("-5");
+  pooled.clear();
+  qDebug()<<copy.size()<<copy.count(3)<<copy.value(4)<<pooled.isEmpty()<<"Expected 999 99 994 true";
+  copy=pooled;
+  qDebug()<<copy.isEmpty()<<"Expected true";
+}
+// Counts its copies and moves, to tell which insertions move
+struct Tracked
+{
+  static int copies, moves;
+  Tracked(int n=0, int m=0): n(n+m) { }
+  Tracked(const Tracked &other): n(other.n) { copies++; }
+  Tracked(Tracked &&other): n(other.n) { moves++; }
+  Tracked &operator=(const Tracked &other) { n=other.n; copies++; return *this; }
+  bool operator<(const Tracked &other) const { return n<other.n; }
+  int n;
+};
+int Tracked::copies=0;
+int Tracked::moves=0;
+void testMoveInsert()
+{
+  qDebug()<<"Move-aware insert";
+  HFBiMap<Tracked, QString> map;
+  Tracked key(1);
+  QString value("One");
+  map.insert(key, std::move(value));
+  map.insert(Tracked(2), QString("Two"));
+  qDebug()<<Tracked::copies<<Tracked::moves<<value.isEmpty()<<"Expected 1 1 true";
+  HFBiMultiMap<QString, Tracked> multi;
+  QString name("a");
+  multi.insert(name, Tracked(3));
+  multi.emplace(name, 4, 5);
+  // Both the key and the value built in place
+  map.emplace(std::piecewise_construct, std::forward_as_tuple(6, 1), std::forward_as_tuple("xxx"));
+  qDebug()<<Tracked::copies<<Tracked::moves<<"Expected 1 2";
+  qDebug()<<multi.findConst("a").value().n<<map.value(Tracked(7))<<"Expected 9 xxx";
+  HFBiCacheMap<int, QString> cache;
+  cache.insert(1, "One");
+  cache.tryEmplace(1, "Uno");
+  cache.tryEmplace(2, "One");
+  cache.tryEmplace(3, "Three");
+  qDebug()<<cache.size()<<cache.stats().hits<<cache.stats().misses<<"Expected 2 0 0";
+}
+void testBuild()
+{
+  qDebug()<<"Bulk construction";
+  std::vector<std::pair<int, QString> > pairs{{3,"C"}, {1,"A"}, {2,"B"}, {1,"D"}, {4,"B"}};
+  HFBiMap<int, QString> map(pairs.begin(), pairs.end());
+  qDebug()<<map.keys()<<map.values()<<"Expected (1, 3, 4) (B, C, D)";
+  HFBiMultiMap<int, QString> multi(pairs.begin(), pairs.end());
+  qDebug()<<multi.size()<<multi.count(1)<<multi.value(1)<<"Expected 5 2 D";
+  QVector<QPair<int, QString> > sorted{qMakePair(1, QString("A")), qMakePair(2, QString("B"))};
+  map.assign(std::move(sorted));
+  qDebug()<<map.keys()<<map.value(2)<<"Expected (1, 2) B";
+}
+void testFlatMap()
+{
+  qDebug()<<"Flat map";
+  HFBiMultiMap<QString, QString> map({{"b","2"}, {"a","1"}, {"c","3"}, {"a","4"}});
+  auto flat=map.freeze();
+  qDebug()<<flat.size()<<flat.count("a")<<flat.value("a")<<flat.key("3")<<"Expected 4 2 4 c";
+  qDebug()<<flat.lowerBound("b").value()<<(flat.findConst("d")==flat.cend())<<flat.findValueConst("1").key()<<"Expected 2 true a";
+  qDebug()<<flat.keys()<<flat.values()<<"Expected (a, a, b, c) (1, 2, 3, 4)";
+  qDebug()<<(flat.thaw<HFBiMultiMap<QString, QString> >()==map)<<"Expected true";
+}
+void testPersistentMap()
+{
+  qDebug()<<"Persistent map";
+  HFBiPersistentMap<int, QString> map({{1,"One"}, {2,"Two"}, {3,"Three"}});
+  auto snapshot=map;
+  map.insert(4, "Four");
+  map.remove(1);
+  map.removeValue("Two");
+  qDebug()<<map.keys()<<snapshot.keys()<<"Expected (3, 4) (1, 2, 3)";
+  auto it=map.find(3);
+  it=map.erase(it);
+  qDebug()<<it.key()<<map.size()<<map.at(0).value()<<snapshot.atValue(0).value()<<"Expected 4 1 Four One";
+}
+void testConcurrentMap()
+{
+  qDebug()<<"Concurrent map";
+  HFBiConcurrentMap<int, int> map;
+  // Two writers: no batch is lost, and every version the reader sees maps i to -i for all its keys
+  auto write=[&map](int from) {
+    for(int i=from;i<from+100;i++)
+      map.update([i](HFBiMap<int, int> &m) { m.insert(i, -i); });
+  };
+  std::thread first(write, 0);
+  std::thread second(write, 100);
+  auto reader=map.reader();
+  int consistent=0;
+  for(int i=0;i<1000;i++)
+    consistent+=reader.read([](const HFBiMap<int, int> &m) { return m.isEmpty() || m.key(-m.last(), 1)==m.last(); });
+  first.join();
+  second.join();
+  map.update([](HFBiMap<int, int> &m) { m.remove(0); });
+  qDebug()<<consistent<<reader.size()<<reader.value(199)<<reader.contains(0)<<"Expected 1000 199 -199 false";
+  auto found=reader.find(5);
+  auto missing=reader.findValue(1);
+  qDebug()<<found.first<<found.second<<missing.first<<missing.second<<"Expected -5 true 0 false";
+}
+void testHeterogeneous()
+{
+  qDebug()<<"Heterogeneous lookups";
+  HFBiMap<QString, QString> map({{"apple","red"}, {"banana","yellow"}, {"cherry","red2"}});
+  const HFBiMap<QString, QString> &constMap=map;
+  QString text("banana");
+  QStringView view(text);
+  qDebug()<<map.value(view)<<map.contains(QLatin1String("apple"))<<map.key(QLatin1String("red2"))<<"Expected yellow true cherry";
+  qDebug()<<constMap.lowerBound(view).key()<<constMap.upperBound(view).key()<<constMap.upperBoundValue(QLatin1String("red")).value()<<"Expected banana cherry red2";
+  qDebug()<<constMap.findConst(view).value()<<(constMap.findValueConst(QLatin1String("blue"))==constMap.constEnd())<<"Expected yellow true";
+}
+void testIntern()
+{
+  qDebug()<<"Interning storage";
+  HFBiInternedMultiMap<int, QString> interned;
+  for(int i=0;i<100;i++)
+    interned.insert(i%10, QString::number(i%3));
+  // Equal values share a single copy, counted without walking the entries
+  qDebug()<<interned.count(3)<<interned.countValue("1")<<(&interned.findConst(1).value()==&interned.findConst(4).value())<<"Expected 10 33 true";
+  interned.remove(3, "0");
+  interned.removeValue("2");
+  qDebug()<<interned.count(3)<<interned.countValue("0")<<interned.countValue("2")<<interned.size()<<"Expected 3 30 0 63";
+}
+void testFindMany()
+{
+  qDebug()<<"Batch lookups";
+  HFBiMap<int, QString> map;
+  for(int i=0;i<1000;i+=2)
+    map.insert(i, QString::number(i));
+  auto found=map.findMany(QVector<int>{998, 3, 0, 500});
+  qDebug()<<found.at(0).value()<<(found.at(1)==map.constEnd())<<found.at(2).value()<<found.at(3).value()<<"Expected 998 true 0 500";
+  auto keys=map.findManyValues(QList<QString>{"7", "40"});
+  qDebug()<<(keys.at(0)==map.constEnd())<<keys.at(1).key()<<"Expected true 40";
+}
+void testMultiIndex()
+{
+  qDebug()<<"Multi index";
+  HFBiMultiIndex<int, QString, QString> people;
+  people.insert(1, "alice", "x st");
+  people.insert(2, "bob", "y st");
+  people.insert(3, "carol", "x st");
+  qDebug()<<people.find<1>("bob").column<0>()<<people.count<2>("x st")<<"Expected 2 2";
+  auto it=people.erase(people.find<0>(2));
+  qDebug()<<it.key()<<people.remove<2>("x st")<<people.size()<<"Expected 3 2 0";
+}
+void testMappedMap()
+{
+  qDebug()<<"Mapped map";
+  HFBiMap<quint64, QString> map;
+  for(quint64 i=0;i<1000;i++)
+    map.insert(i*2, QString::number(i));
+  QBuffer buffer;
+  buffer.open(QIODevice::WriteOnly);
+  qDebug()<<HFBiMappedMap<quint64, QString>::save(map, &buffer)<<"Expected true";
+  HFBiMappedMap<quint64, QString> snapshot;
+  qDebug()<<snapshot.setData(buffer.data())<<snapshot.size()<<snapshot.value(10)<<snapshot.key("999")<<"Expected true 1000 5 1998";
+  qDebug()<<(snapshot.thaw()==map)<<"Expected true";
+  // Truncated snapshots are rejected
+  HFBiMappedMap<quint64, QString> truncated;
+  qDebug()<<truncated.setData(buffer.data().left(buffer.data().size()-8))<<truncated.isOpen()<<"Expected false false";
+}
+void testStats()
+{
+  qDebug()<<"Statistics";
+  HFBiStatsMultiMap<int, QString> stats;
+  for(int i=0;i<100;i++)
+    stats.insert(i%10, QString::number(i));
+  qDebug()<<stats.stats().allocations<<(stats.stats().comparisons>0)<<"Expected 100 true";
+  stats.resetStats();
+  stats.remove(5);
+  qDebug()<<stats.stats().scans<<stats.stats().scanned<<stats.stats().frees<<"Expected 1 10 10";
+}
+void testArena()
+{
+  qDebug()<<"Allocator map";
+  HFBiMapArena arena;
+  {
+    HFBiAllocatorMap<int, QString, HFBiMapArenaAllocator<int> > allocated(HFBiMapArenaAllocator<int>{arena});
+    for(int i=0;i<10;i++)
+      allocated.insert(i, QString::number(i*11));
+    qDebug()<<allocated.size()<<allocated.value(9)<<(arena.used()>0)<<"Expected 10 99 true";
+    HFBiAllocatorMap<int, QString, HFBiMapArenaAllocator<int> > moved(std::move(allocated));
+    moved.insert(10, "110");
+    qDebug()<<moved.size()<<moved.key("110")<<"Expected 11 10";
+  }
+}
+void testPrefix()
+{
+  qDebug()<<"Prefix map";
+  HFBiPrefixMap<QString, QString> prefix({{"alpha","1"}, {"alphabet","2"}, {"alphabetical","3"}, {"beta","4"}});
+  qDebug()<<prefix.value("alphabet")<<prefix.value("alphabetical")<<prefix.key("1")<<"Expected 2 3 alpha";
+  // Keys sharing their first characters fall back to the full comparison
+  qDebug()<<prefix.keys()<<prefix.contains("alphabe")<<"Expected (alpha, alphabet, alphabetical, beta) false";
+}
+void testRank()
+{
+  qDebug()<<"Rank and select";
+  HFBiPersistentMap<int, QString> map;
+  for(int i=0;i<100;i++)
+    map.insert(i*2, QString::number(1000-i));
+  qDebug()<<map.rank(50)<<map.rank(51)<<map.at(25).key()<<map.atValue(0).value()<<"Expected 25 26 50 1000";
+  auto it=map.constBegin();
+  it+=60;
+  it-=10;
+  qDebug()<<it.key()<<(map.at(100)==map.constEnd())<<"Expected 100 true";
+  HFBiMap<int, QString> bimap({{1,"a"}, {2,"b"}, {3,"c"}});
+  auto flat=bimap.freeze();
+  qDebug()<<flat.rankValue("b")<<flat.atValue(2).value()<<"Expected 1 c";
+  auto bit=bimap.constBegin()+2;
+  --bit;
+  qDebug()<<bit.key()<<(bit-1).value()<<"Expected 2 a";
+}
+void testRemove()
+{
+  HFBiMultiMap<int, QString> map({{4,"Foo"}, {6,"Tail"}, {15,"Fee"}, {4,"Foo2"}, {7,"Fee"}, {14,"Boo"}, {9,"Edge"}});
+  {
+    qDebug()<<"Remove";
+    auto map2=map;
+    qDebug()<<map2.remove(4)<<map2.remove(8)<<map2.size()<<"Expected 2 0 5";
+    qDebug()<<map2.removeValue("Fee")<<map2.size()<<map.size()<<"Expected 2 3 7";
+    qDebug()<<map2.remove(14, "Boo")<<map2.remove(9, "Boo")<<map2.keys()<<"Expected 1 0 (6, 9)";
+    map2=map;
+    qDebug()<<map2.removeRange(5, 10)<<map2.keys()<<"Expected 3 (4, 4, 14, 15)";
+    qDebug()<<map2.removeValueRange("Fee", "Foo")<<map2.values()<<"Expected 2 (Boo, Foo2)";
+  }
+  {
+    qDebug()<<"Remove last entry";
+    HFBiMap<int, QString> single({{1,"One"}});
+    qDebug()<<single.remove(1)<<single.isEmpty()<<(single.begin()==single.end())<<"Expected 1 true true";
+    single.insert(2, "Two");
+    qDebug()<<single.take(2)<<single.takeValue("Two", -1)<<"Expected Two -1";
+    // Removing the last entry is journaled as its removal, not as a clear
+    HFBiJournalMap<int, QString> journaled({{1,"One"}});
+    quint64 version=journaled.version();
+    journaled.remove(1);
+    auto delta=journaled.changesSince(version);
+    qDebug()<<delta.changes.size()<<(delta.changes.first().type==HFBiMapChange<int, QString>::Removed)<<delta.changes.first().value<<"Expected 1 true One";
+  }
+  {
+    qDebug()<<"Erase";
+    auto map2=map;
+    auto it=map2.findValue("Edge");
+    it=map2.erase(it);
+    qDebug()<<it.key()<<it.value()<<"Expected 7 Fee";
+    for(it=map2.begin();it!=map2.end();)
+      it=map2.erase(it);
+    qDebug()<<map2.size()<<map.size()<<"Expected 0 7";
+  }
+}
+void testCount()
+{
+  qDebug()<<"Count";
+  HFBiMultiMap<int, QString> map({{4,"Foo"}, {6,"Tail"}, {15,"Fee"}, {4,"Foo2"}, {7,"Fee"}, {14,"Boo"}, {4,"Edge"}});
+  qDebug()<<map.count(4)<<map.count(8)<<map.countValue("Fee")<<map.countValue("Foo3")<<"Expected 3 0 2 0";
+  map.remove(4, "Foo2");
+  map.insert(8, "Fee");
+  qDebug()<<map.count(4)<<map.count(8)<<map.countValue("Fee")<<"Expected 2 1 3";
+  const HFBiMultiMap<int, QString> &constMap=map;
+  auto range=constMap.equalRangeValue("Fee");
+  QList<int> keys;
+  for(auto it=range.first;it!=range.second;++it)
+    keys.append(it.key());
+  qDebug()<<keys<<"Expected (8, 7, 15)";
+  // The counts are kept up to date, not found by walking the entries
+  HFBiStatsMultiMap<int, QString> stats({{1,"a"}, {1,"b"}, {1,"c"}, {2,"a"}});
+  stats.resetStats();
+  qDebug()<<stats.count(1)<<stats.countValue("a")<<stats.stats().scans<<"Expected 3 2 0";
+}
+void testSetAlgebra()
+{
+  qDebug()<<"Set algebra";
+  HFBiMap<int, QString> a({{1,"a"}, {2,"b"}, {3,"c"}});
+  HFBiMap<int, QString> b({{3,"c"}, {4,"d"}, {5,"a"}});
+  auto united=a;
+  united.unite(b);
+  qDebug()<<united.keys()<<united.values()<<"Expected (2, 3, 4, 5) (a, b, c, d)";
+  auto common=a;
+  common.intersect(b);
+  auto rest=a;
+  rest.subtract(b);
+  qDebug()<<common.keys()<<rest.keys()<<"Expected (3) (1, 2)";
+  HFBiMultiMap<int, QString> m({{1,"a"}, {1,"b"}});
+  HFBiMultiMap<int, QString> n({{1,"a"}, {2,"c"}});
+  m.merge(std::move(n));
+  qDebug()<<m.size()<<m.count(1)<<n.isEmpty()<<"Expected 4 3 true";
+}
+void testJournal()
+{
+  qDebug()<<"Journal";
+  HFBiJournalMap<int, QString> map;
+  HFBiJournalMap<int, QString> replica;
+  map.insert(1, "One");
+  map.insert(2, "Two");
+  replica.applyDelta(map.changesSince(0));
+  quint64 synced=map.version();
+  map.insert(1, "Uno");
+  map.removeValue("Two");
+  map.insert(3, "Three");
+  auto delta=map.changesSince(synced);
+  qDebug()<<delta.from<<delta.to<<delta.changes.size()<<"Expected"<<synced<<map.version()<<"4";
+  replica.applyDelta(delta);
+  qDebug()<<(replica==map)<<replica.keys()<<replica.values()<<"Expected true (1, 3) (Three, Uno)";
+  // Once trimmed, the journal resends the whole map
+  map.trimJournal(map.version());
+  HFBiJournalMap<int, QString> late;
+  late.applyDelta(map.changesSince(1));
+  qDebug()<<(late==map)<<"Expected true";
+  // A journal over a cache still evicts
+  typedef HFBiMapJournalStorage<int, QString, HFBiMapCacheStorage<int, QString> > Journal;
+  HFBiMap<int, QString, Journal> cached(Journal(HFBiMapCacheStorage<int, QString>(2)));
+  cached.insert(1, "One");
+  cached.insert(2, "Two");
+  cached.insert(3, "Three");
+  qDebug()<<cached.keys()<<cached.changesSince(0).changes.size()<<"Expected (2, 3) 4";
+}
+void testCache()
+{
+  qDebug()<<"Cache";
+  HFBiCacheMap<int, QString> lru(HFBiMapCacheStorage<int, QString>(3));
+  lru.insert(1, "One");
+  lru.insert(2, "Two");
+  lru.insert(3, "Three");
+  lru.find(1);
+  lru.insert(4, "Four");
+  qDebug()<<lru.keys()<<"Expected (1, 3, 4)";
+  // Lookups on a copy don't change what the original evicts
+  HFBiCacheMap<int, QString> copy(lru);
+  copy.findConst(3);
+  lru.insert(5, "Five");
+  qDebug()<<lru.keys()<<copy.keys()<<"Expected (1, 4, 5) (1, 3, 4)";
+  lru.findMany(QVector<int>{1, 2});
+  qDebug()<<lru.stats().hits<<lru.stats().misses<<lru.stats().evictions<<"Expected 2 1 2";
+  HFBiCacheMap<int, QString> lfu(HFBiMapCacheStorage<int, QString>(2, HFBiMapCacheStorage<int, QString>::LFU));
+  lfu.insert(1, "One");
+  lfu.insert(2, "Two");
+  lfu.find(1);
+  lfu.find(1);
+  lfu.findValue("Two");
+  lfu.insert(3, "Three");
+  qDebug()<<lfu.keys()<<"Expected (1, 3)";
+  lfu.remove(1);
+  lfu.insert(4, "Four");
+  qDebug()<<lfu.keys()<<"Expected (3, 4)";
+  // A moved-from cache is empty, and evicts none of the entries it gave away
+  HFBiCacheMap<int, QString> moved(std::move(lfu));
+  lfu.insert(5, "Five");
+  lfu.insert(6, "Six");
+  lfu.insert(7, "Seven");
+  qDebug()<<moved.keys()<<lfu.keys()<<moved.stats().evictions<<"Expected (3, 4) (6, 7) 1";
+  // An entry costing more than the whole budget evicts all the others, and is kept alone
+  HFBiCacheMap<int, QString> sized(HFBiMapCacheStorage<int, QString>(10, HFBiMapCacheStorage<int, QString>::LRU, [](const int &, const QString &value) { return qint64(value.size()); }));
+  sized.insert(1, "abc");
+  sized.insert(2, "defg");
+  sized.insert(3, "hijklmnopqrs");
+  qDebug()<<sized.keys()<<sized.stats().evictions<<"Expected (3) 2";
+}
+void testParallelBuild()
+{
+  qDebug()<<"Parallel build";
+  // Large builds sort and fill the indexes on several threads
+  const int n=HFBiMapData<int, int, HFBiMapHeapStorage<int, int> >::ParallelMinimum;
+  QVector<std::pair<int, int> > pairs;
+  for(int i=0;i<n;i++)
+    pairs.append(std::make_pair((i*7919)%n, -i));
+  HFBiMap<int, int> built;
+  built.assign(pairs.begin(), pairs.end());
+  qDebug()<<built.size()<<built.key(-1000)<<built.value(7919)<<built.firstKey()<<"Expected"<<n<<"54680 -1 0";
+  HFBiMultiMap<int, int> multi;
+  for(int i=0;i<n;i++)
+    pairs[i]=std::make_pair(i%100, i%7);
+  multi.assign(pairs);
+  qDebug()<<multi.size()<<multi.count(5)<<multi.count(50)<<multi.countValue(6)<<"Expected"<<n<<"656 655 9362";
+}
+void testFlatIndex()
+{
+  qDebug()<<"Flat map with integer keys";
+  HFBiMultiMap<int, int> map;
+  for(int i=0;i<1000;i++)
+    map.insert(i%100, i);
+  auto flat=map.freeze();
+  qDebug()<<flat.size()<<flat.count(7)<<flat.key(507)<<flat.findConst(7).value()<<"Expected 1000 10 7 907";
+  qDebug()<<flat.lowerBound(50).key()<<flat.upperBoundValue(998).value()<<(flat.findValueConst(1000)==flat.cend())<<"Expected 50 999 true";
+  auto thawed=flat.thaw<HFBiMultiMap<int, int> >();
+  qDebug()<<(thawed==map)<<thawed.count(7)<<"Expected true 10";
+}
+void testDenseMap()
+{
+  qDebug()<<"Dense map";
+  HFBiDenseMap<int, int> map;
+  map.insert(100, 1);
+  // The range grows down and up to take the new keys and values
+  map.insert(-5000, 2);
+  map.insert(70000, -3);
+  qDebug()<<map.keys()<<map.values()<<map.key(-3)<<"Expected (-5000, 100, 70000) (-3, 1, 2) 70000";
+  qDebug()<<map.insert(1<<30, 4)<<map.insert(5, std::numeric_limits<int>::min())<<map.size()<<"Expected false false 3";
+  qDebug()<<map.remove(100)<<map.removeValue(2)<<map.keys()<<"Expected 1 1 (70000)";
+  // Each side can span as many integers as a QVector of its slots can hold, fewer for the keys as their slots are larger
+  HFBiDenseMap<int, int> wide;
+  const int keySlots=HFBiDenseIndex<int, QPair<int, quint64> >::MaximumSlots, valueSlots=HFBiDenseIndex<int, int>::MaximumSlots;
+  wide.insert(0, 0);
+  qDebug()<<wide.insert(keySlots, 1)<<wide.insert(1, valueSlots)<<wide.size()<<(keySlots<valueSlots)<<"Expected false false 1 true";
+  HFBiMap<int, int> source({{1,10}, {2,20}});
+  HFBiDenseMap<int, int> copy(source);
+  qDebug()<<copy.value(2)<<copy.lowerBound(0).key()<<"Expected 20 1";
 }
 //void testBiMap()
 //{